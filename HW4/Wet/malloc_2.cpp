@@ -101,7 +101,7 @@ void* smalloc(size_t size)
         if (last_searched == nullptr) {
             return nullptr;
         }
-        if (last_searched->is_free) {
+        if (last_searched->is_free && last_searched->size >= block_size) {
             last_searched->is_free = false;
             free_blocks_num--;
             free_bytes_num -= last_searched->size - _size_meta_data();
@@ -444,7 +444,8 @@ void* srealloc(void* oldp, size_t size)
     if (newp == nullptr) {
         return nullptr;
     }
-    memmove(newp, oldp, size);
+    size_t old_size = old_block->size - _size_meta_data();
+    memmove(newp, oldp, (old_size < size) ? old_size : size);
     sfree(oldp);
     return newp;
 }
@@ -1,46 +1,393 @@
+#include <cmath>
+#include <cstdarg>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
 
+// The drop-in library is built with MALLOC4_NO_SIZE_LIMIT, a program may ask for more than 1e8 bytes
+#ifdef MALLOC4_NO_SIZE_LIMIT
+#define SIZE_LIMIT (SIZE_MASK / 2) // leaves room for rounding the block size up
+#else
 #define SIZE_LIMIT (1e8)
+#endif
 #define SBRK_LIMIT (128 * 1024 + _size_meta_data()) // 128 KB
 #define HUGE_PAGE_LIMIT (4 * 1024 * 1024) // 4MB
 #define SCALLOC_HUGE_PAGE_LIMIT (2 * 1024 * 1024) // 2MB
+// The slab region, the arena heaps and the buddy regions are reserved at a THP_SIZE boundary and
+// marked with MADV_HUGEPAGE so the kernel can back them with transparent huge pages, as are huge page
+// blocks when no hugetlbfs pages are reserved. MALLOC4_THP=0 marks them MADV_NOHUGEPAGE instead
+#define THP_SIZE ((size_t)2 * 1024 * 1024) // 2MB
+#define THP_ENV "MALLOC4_THP"
 #define REDUNDANT_SIZE (128 + _size_meta_data())
-#define IS_REDUNDANT(block, block_size) ((block)->size - (block_size) >= REDUNDANT_SIZE)
-#define TAIL_METADATA(block) ((tail_metadata_t*)((uint8_t*)(block) + ((block)->size - sizeof(tail_metadata_t))))
-#define IS_SBRK_ALLOC(block) ((block)->size < SBRK_LIMIT)
+#define IS_REDUNDANT(block, block_size) (BLOCK_SIZE(block) - (block_size) >= REDUNDANT_SIZE)
+#define IS_SBRK_ALLOC(block) (!IS_MMAP_BLOCK(block) && !IS_BUDDY_PTR(block))
 #define ALLOC_SBRK(block_size) ((block_size) < SBRK_LIMIT)
 
-// We use the next field in head_metadata as a flag to check if the block is inside huge page
+// A free top block of TRIM_THRESHOLD bytes or more is trimmed down to TRIM_PAD bytes, and the pages
+// of a block freed into a free block of RELEASE_THRESHOLD bytes or more are given back with madvise
+#define OS_PAGE_SIZE 4096
+#define TRIM_THRESHOLD (256 * 1024)
+#define TRIM_PAD (128 * 1024)
+#define RELEASE_THRESHOLD (256 * 1024)
+#define PAGE_ROUND_UP(size) (((size) + OS_PAGE_SIZE - 1) & ~((size_t)OS_PAGE_SIZE - 1))
+
+// Freed mmap blocks are kept mapped by their page rounded length and reused by mmap requests of up to
+// MMAP_CACHE_SLACK less. A chunk is unmapped once it is MMAP_CACHE_MAX_AGE old or to keep the cache
+// under MMAP_CACHE_MAX_BYTES, oldest first. Huge page blocks are never cached
+#define MMAP_CACHE_SLOTS 32
+#define MMAP_CACHE_MAX_BYTES (64 * 1024 * 1024) // 64MB
+#define MMAP_CACHE_MAX_AGE (1000 * 1000 * 1000) // 1 second in nanoseconds
+#define MMAP_CACHE_SLACK(length) ((length) / 8)
+// An mmap block starts BLOCK_OFFSET bytes into its mapping unless it was aligned, then its header is
+// elsewhere inside of the first page
+#define MMAP_START(block) ((uint8_t*)((uintptr_t)(block) & ~((uintptr_t)OS_PAGE_SIZE - 1)))
+#define MMAP_END(block) ((uint8_t*)PAGE_ROUND_UP((uintptr_t)NEXT_BLOCK(block)))
+
+// An allocated block only has an 8 byte header that packs its size with the flags, its arena and a
+// cookie. A free block also keeps its links at the start of its payload and its size in a footer
+// at its end, the block after it has PREV_FREE set so the footer is only read when it is there.
+// Headers are accessed atomically since PREV_FREE is set under the lock while the owner reads them
+#define FREE_BIT ((uint64_t)1)
+#define PREV_FREE_BIT ((uint64_t)2)
+#define MMAPPED_BIT ((uint64_t)4)
+// Set on allocated blocks the heap profiler sampled
+#define SAMPLED_BIT ((uint64_t)1 << 39)
+#define HUGE_PAGE_BIT ((uint64_t)1 << 46)
+// A free sbrk block is ZEROED when all of it but its links and footer is known to be zero, it came
+// from above the break or its pages were released. Taking the block clears it and tells scalloc
+#define ZEROED_BIT ((uint64_t)1 << 47)
+#define SIZE_MASK ((((uint64_t)1 << 39) - 1) & ~(uint64_t)7) // up to 512GB
+#define ARENA_SHIFT 40
+#define COOKIE_SHIFT 48
+#define COOKIE_MASK 0xffff
+#define HEADER_SIZE sizeof(uint64_t)
+// Payloads are PAYLOAD_ALIGNMENT aligned like glibc's (alignof(max_align_t)). Block sizes are multiples
+// of it and every heap, mapping and buddy region starts BLOCK_OFFSET bytes past an aligned address
+#define PAYLOAD_ALIGNMENT 16
+#define BLOCK_OFFSET (PAYLOAD_ALIGNMENT - HEADER_SIZE)
+#define ALIGN_UP(size, alignment) (((size) + (alignment) - 1) & ~((size_t)(alignment) - 1))
+#define MIN_BLOCK_SIZE (sizeof(head_metadata_t) + sizeof(size_t)) // header, links and footer
+#define HEADER(block) __atomic_load_n(&(block)->header, __ATOMIC_RELAXED)
+#define BLOCK_SIZE(block) (HEADER(block) & SIZE_MASK)
+#define IS_FREE(block) (HEADER(block) & FREE_BIT)
+#define IS_PREV_FREE(block) (HEADER(block) & PREV_FREE_BIT)
+#define IS_MMAP_BLOCK(block) (HEADER(block) & MMAPPED_BIT)
+#define IS_HUGE_PAGE(block) (HEADER(block) & HUGE_PAGE_BIT)
+#define IS_ZEROED(block) (HEADER(block) & ZEROED_BIT)
+#define IS_SAMPLED(block) (HEADER(block) & SAMPLED_BIT)
+#define FOOTER(end) (*(size_t*)((uint8_t*)(end) - sizeof(size_t)))
+#define NEXT_BLOCK(block) ((head_metadata_t*)((uint8_t*)(block) + BLOCK_SIZE(block)))
+
+// With the buddy engine an aligned pointer inside of a block payload is preceded by a tag word instead
+// of a header, it holds the offset back to the payload. A real header never has all three flags set
+#define ALIGNED_TAG (FREE_BIT | PREV_FREE_BIT | MMAPPED_BIT)
+#define IS_ALIGNED_TAG(block) ((HEADER(block) & ALIGNED_TAG) == ALIGNED_TAG)
+#define ALIGNED_OFFSET(block) (HEADER(block) >> 3)
+
+// Free blocks are kept in bins, exact bins hold a single block size (8 bytes apart) so any of
+// their blocks is a best fit, the rest are log spaced with 8 bins per power of two. A log bin is a
+// treap ordered by (size, address) that lives in the free blocks, prev and next are the left and
+// right children and the priority is a hash of the block address
+#define EXACT_BINS_NUM 128
+#define EXACT_BINS_LIMIT (EXACT_BINS_NUM * 8) // 1KB
+#define LOG_BINS_SHIFT 3
+#define BINS_NUM 256
+#define BITMAP_WORDS (BINS_NUM / 64)
+
+// Every thread caches freed allocations of up to 512 bytes in per size bins, a bin is refilled from
+// and drained to the locked arena in batches so most smalloc/sfree calls don't take the lock.
+// Cached pointers are linked through their first payload word
+#define TCACHE_BINS_NUM 64
+#define TCACHE_SIZE_LIMIT (TCACHE_BINS_NUM * 8) // 512 bytes
+#define TCACHE_BIN_CAPACITY 32
+#define TCACHE_BATCH (TCACHE_BIN_CAPACITY / 2)
+#define IS_TCACHE_SIZE(size) ((size) <= TCACHE_SIZE_LIMIT)
+#define TCACHE_BIN(size) (&tcache[(size) / 8 - 1])
+// sfree_batch sorts the heap blocks it frees in copies of this many pointers on the stack
+#define FREE_BATCH_CHUNK 256
+#define NEXT_FREE(p) (*(void**)(p))
+// Cached and remotely freed blocks and slab slots stay allocated for the heap until they are given
+// back to it, a random mark in their second payload word (the prev link of a free block) catches
+// double frees
+#define CACHED_MARK ((head_metadata_t*)cached_mark)
+#define BLOCK_OF(p) ((head_metadata_t*)((uint8_t*)(p) - HEADER_SIZE))
+#define PAYLOAD_OF(block) ((void*)((uint8_t*)(block) + HEADER_SIZE))
+
+// Allocations of up to 256 bytes are slots of page sized slabs, one slab per slot size. The slots
+// have no header, the slab is found by masking the pointer and a bitmap tracks its free slots.
+// All slabs are carved from one reserved region so a pointer is a slot if it is inside of it
+#define SLAB_SIZE 4096
+#define SLAB_SIZE_LIMIT 256
+#define SLAB_CLASSES_NUM (SLAB_SIZE_LIMIT / 8)
+#define SLAB_BITMAP_WORDS (SLAB_SIZE / 8 / 64)
+#define SLAB_REGION_SIZE ((size_t)1 << 30) // 1GB of address space
+#define IS_SLAB_SIZE(size) ((size) <= SLAB_SIZE_LIMIT)
+#define IS_SLAB_PTR(p) ((uint8_t*)(p) >= slab_region && (uint8_t*)(p) < slab_region + SLAB_REGION_SIZE)
+#define SLAB_OF(p) ((slab_t*)((uintptr_t)(p) & ~((uintptr_t)SLAB_SIZE - 1)))
+#define SLAB_HEADER_SIZE ALIGN_UP(sizeof(slab_t), PAYLOAD_ALIGNMENT)
+#define SLAB_SLOTS(slab) ((uint8_t*)(slab) + SLAB_HEADER_SIZE)
+
+// srealloc keeps the last pointers it grew per thread, REALLOC_TRACKED of them by their address. A
+// block that is grown again is given REALLOC_SLACK more bytes than asked for, and later growth that
+// fits in that slack returns at once. Shrinking it goes the usual way and gives the slack back
+#define REALLOC_TRACKED 8
+#define REALLOC_SLACK(size) ((size) / 2)
+#define REALLOC_GROWTH_OF(p) (&realloc_growths[((uintptr_t)(p) >> 4) % REALLOC_TRACKED])
+
+// The buddy engine replaces the best fit sbrk engine with power of two blocks of 64B to 256KB, split
+// from 256KB top blocks of a reserved region per arena that is committed as it is used, like the
+// arena heaps. A bitmap per order marks the free blocks so checking a buddy is O(1). The engine is
+// picked by MALLOC4_ENGINE or MALLOC4_BUDDY at compile time. The region stays null under the sbrk
+// engine, so IS_BUDDY_PTR never matches then
+#define ENGINE_ENV "MALLOC4_ENGINE"
+#define BUDDY_MIN_ORDER 6 // 64 bytes
+#define BUDDY_MAX_ORDER 18 // 256KB
+#define BUDDY_ORDERS_NUM (BUDDY_MAX_ORDER - BUDDY_MIN_ORDER + 1)
+#define BUDDY_TOP_SIZE ((size_t)1 << BUDDY_MAX_ORDER)
+#define BUDDY_REGION_SIZE ARENA_HEAP_SIZE
+#define BUDDY_ORDER_SIZE(order) ((size_t)1 << (BUDDY_MIN_ORDER + (order)))
+#define IS_BUDDY_PTR(p) (buddy_region != nullptr && (uint8_t*)(p) >= buddy_region && (uint8_t*)(p) < buddy_region + arenas_num * BUDDY_REGION_SIZE)
+#ifdef MALLOC4_BUDDY
+#define DEFAULT_ENGINE BUDDY_ENGINE
+#else
+#define DEFAULT_ENGINE SBRK_ENGINE
+#endif
+
+// A region hands out memory by bumping a pointer through chunks of REGION_CHUNK_SIZE bytes and frees
+// all of it at once. A reset region keeps its newest chunk and gives the others to a pool that every
+// region takes its chunks from first, up to REGION_POOL_MAX_CHUNKS are kept there. Allocations of
+// more than REGION_LARGE_SIZE get a block of their own that is freed on reset. Region allocations are
+// PAYLOAD_ALIGNMENT aligned like the rest, the link of a chunk or large block is padded to keep them so
+#define REGION_CHUNK_SIZE (64 * 1024) // a heap block
+#define REGION_CHUNK_HEADER_SIZE ALIGN_UP(sizeof(region_chunk_t), PAYLOAD_ALIGNMENT)
+#define REGION_DATA(chunk) ((uint8_t*)(chunk) + REGION_CHUNK_HEADER_SIZE)
+#define REGION_LARGE_SIZE (REGION_CHUNK_SIZE / 4)
+#define REGION_POOL_MAX_CHUNKS 256 // 16MB
+
+// The heap profiler is off unless MALLOC4_PROFILE gives the average number of bytes allocated between
+// two samples. Every thread counts the bytes it allocates down from a random exponential distance and
+// the allocation that crosses zero is sampled, it gets a heap block with SAMPLED set and its backtrace,
+// size and time are recorded. Samples are aggregated per backtrace and written in the legacy pprof
+// heap format to <MALLOC4_PROFILE_PREFIX>.<pid>.<n>.heap on PROFILE_SIGNAL and at exit, the lifetime
+// of the freed samples is added as comments. smalloc, scalloc and srealloc are sampled
+#define PROFILE_ENV "MALLOC4_PROFILE"
+#define PROFILE_PREFIX_ENV "MALLOC4_PROFILE_PREFIX"
+#define PROFILE_DEFAULT_PREFIX "malloc4"
+#define PROFILE_SIGNAL SIGUSR2
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_BUCKETS_NUM 4096 // distinct backtraces
+#define PROFILE_SAMPLES_NUM (64 * 1024) // live samples, the table is kept at most 3/4 full
+#define PROFILE_LINE_SIZE 1024
+#define PROFILE_CHARGE(size) ((profile_countdown -= (intptr_t)(size)) < 0)
+
+// The heap integrity checks are picked at compile time by MALLOC4_CHECK_LEVEL. CHECK_NONE leaves the
+// cookie out of the headers and compiles every check away, CHECK_FREE only checks the cookie of the
+// block given to sfree and catches double frees of blocks and of slab slots (by their slab bitmap
+// and cache mark, slots have no cookie), CHECK_FULL also checks every block the free lists and
+// merges walk over
+#define CHECK_NONE 0
+#define CHECK_FREE 1
+#define CHECK_FULL 2
+#ifndef MALLOC4_CHECK_LEVEL
+#define MALLOC4_CHECK_LEVEL CHECK_FULL
+#endif
+
+// Every thread is bound to one of the arenas, each arena is a separate heap with its own lock and a
+// reserved mapping of its own, the program break is never touched
+#define MAX_ARENAS 64
+#define ARENAS_ENV "MALLOC4_ARENAS"
+#define ARENA_HEAP_SIZE ((size_t)1 << 36) // 64GB of address space
+#define HEAP_COMMIT_SIZE THP_SIZE
+#define HEAP_COMMIT_ROUND_UP(address) (((address) + HEAP_COMMIT_SIZE - 1) & ~((uintptr_t)HEAP_COMMIT_SIZE - 1))
+#define HEAP_START(arena) ((uint8_t*)(arena)->heap_end - ARENA_HEAP_SIZE)
+
+// With MALLOC4_SIDE_TABLE the free heap blocks are also marked out of band. Every arena heap has a
+// side table with an entry per 64KB chunk, a bitmap with a bit per 8 bytes that is set at the
+// header of each free block and a mask of its nonzero words. Whether a neighbor is free is then
+// read from the table instead of from the neighbor's header, and trimming finds the free blocks
+// with word scans instead of walking the bins block by block
+#define SIDE_CHUNK_SIZE (64 * 1024)
+#define SIDE_CHUNK_GRANULES (SIDE_CHUNK_SIZE / 8)
+#define SIDE_CHUNK_WORDS (SIDE_CHUNK_GRANULES / 64)
+#define SIDE_TABLE_SIZE (ARENA_HEAP_SIZE / SIDE_CHUNK_SIZE * sizeof(side_chunk_t))
+#define BLOCK_ARENA(block) (&arenas[(HEADER(block) >> ARENA_SHIFT) & (MAX_ARENAS - 1)])
+
 typedef enum {
-    REGULAR_PAGE,
-    HUGE_PAGE
-} mmap_page_type_e;
+    SBRK_ENGINE,
+    BUDDY_ENGINE
+} heap_engine_e;
 
 typedef struct head_metadata {
-    size_t size;
-    size_t is_free;
+    uint64_t header;
+    // The links are the first payload words and only valid while the block is free
     struct head_metadata* next;
     struct head_metadata* prev;
 } head_metadata_t;
 
 typedef struct {
-    uint32_t cookie;
+    void* head;
+    size_t count;
+} tcache_bin_t;
+
+typedef struct slab {
+    struct slab* next;
+    struct slab* prev;
+    uint32_t arena;
+    uint32_t slot_size;
+    uint32_t slots_num;
+    uint32_t used_num;
+    // A set bit is a free slot
+    uint64_t free_bitmap[SLAB_BITMAP_WORDS];
+} slab_t;
+
+typedef struct {
+    void* chunk;
+    size_t length;
+    uint64_t freed_at;
+} mmap_chunk_t;
+
+typedef struct {
+    // Guards everything below
+    pthread_mutex_t lock;
+    mmap_chunk_t chunks[MMAP_CACHE_SLOTS];
+    size_t chunks_num;
+    size_t bytes;
+    size_t hits;
+    size_t misses;
+} mmap_cache_t;
+
+typedef struct {
+    // A set bit is a nonzero word of free_bitmap
+    uint64_t words_mask[SIDE_CHUNK_WORDS / 64];
+    uint64_t free_bitmap[SIDE_CHUNK_WORDS];
+} side_chunk_t;
+
+typedef struct {
+    void* p;
+    // The size it was last asked to have
     size_t size;
-} tail_metadata_t;
+} realloc_growth_t;
 
-uint32_t global_rand_cookie = 0;
-head_metadata_t* sbrk_head = nullptr;
-head_metadata_t* sbrk_free_head = nullptr;
+typedef struct {
+    uint64_t hash;
+    // 0 for an unused bucket
+    uint32_t depth;
+    void* stack[PROFILE_MAX_DEPTH];
+    size_t alloc_objects;
+    size_t alloc_bytes;
+    size_t inuse_objects;
+    size_t inuse_bytes;
+    size_t freed_objects;
+    uint64_t lifetime_ns;
+} profile_bucket_t;
+
+typedef struct {
+    // nullptr for an unused slot
+    head_metadata_t* block;
+    uint32_t bucket;
+    size_t size;
+    uint64_t allocated_at;
+} profile_sample_t;
+
+typedef struct {
+    // Guards everything below, it is taken before any arena lock
+    pthread_mutex_t lock;
+    profile_bucket_t* buckets;
+    profile_sample_t* samples;
+    size_t samples_num;
+    size_t dumps_num;
+    // Set by the signal handler when the lock was held, the holder dumps before it unlocks
+    int dump_pending;
+    char prefix[256];
+} profile_t;
 
-size_t free_blocks_num = 0;
-size_t free_bytes_num = 0;
-size_t allocated_blocks_num = 0;
-size_t allocated_bytes_num = 0;
+typedef struct region_chunk {
+    struct region_chunk* next;
+} region_chunk_t;
+
+// Used by one thread at a time, only the pool is shared
+typedef struct sregion {
+    // Newest first, the bump pointer is inside of the first one
+    region_chunk_t* chunks;
+    region_chunk_t* last_chunk;
+    size_t chunks_num;
+    region_chunk_t* large_blocks;
+    uint8_t* cursor;
+    uint8_t* limit;
+} sregion_t;
+
+typedef struct {
+    // Guards everything below
+    pthread_mutex_t lock;
+    region_chunk_t* chunks;
+    size_t chunks_num;
+} region_pool_t;
+
+typedef struct arena {
+    // Guards everything below
+    pthread_mutex_t lock;
+    uint32_t index;
+    size_t threads_num;
+    // Pointers freed by threads of other arenas, pushed without the lock and drained under it
+    void* remote_frees;
+    head_metadata_t* sbrk_head;
+    void* heap_break;
+    void* heap_committed;
+    void* heap_end;
+    side_chunk_t* side_table;
+    // PREV_FREE of the heap break, set when the last block is free
+    bool break_prev_free;
+    head_metadata_t* free_bins[BINS_NUM];
+    uint64_t bins_bitmap[BITMAP_WORDS];
+    size_t free_blocks_num;
+    size_t free_bytes_num;
+    size_t allocated_blocks_num;
+    size_t allocated_bytes_num;
+    // Slabs with free slots per slot size and slabs with no used slots of any size
+    slab_t* partial_slabs[SLAB_CLASSES_NUM];
+    slab_t* empty_slabs;
+    size_t slabs_num;
+    size_t slab_slots_num;
+    // Buddy engine
+    uint8_t* buddy_base;
+    uint8_t* buddy_top;
+    uint8_t* buddy_committed;
+    head_metadata_t* buddy_free_lists[BUDDY_ORDERS_NUM];
+    uint64_t* buddy_bitmaps[BUDDY_ORDERS_NUM];
+    uint32_t buddy_orders_mask;
+} arena_t;
+
+uint32_t global_rand_cookie = 0;
+uintptr_t cached_mark = 0;
+arena_t arenas[MAX_ARENAS];
+size_t arenas_num = 0;
+size_t cpus_num = 0;
+size_t next_arena = 0;
+pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+pthread_key_t thread_key;
+uint8_t* slab_region = nullptr;
+size_t slab_region_used = 0;
+heap_engine_e heap_engine = DEFAULT_ENGINE;
+bool thp_enabled = true;
+uint8_t* buddy_region = nullptr;
+mmap_cache_t mmap_cache = { PTHREAD_MUTEX_INITIALIZER };
+region_pool_t region_pool = { PTHREAD_MUTEX_INITIALIZER };
+profile_t profile = { PTHREAD_MUTEX_INITIALIZER };
+size_t profile_period = 0;
+static __thread arena_t* thread_arena = nullptr;
+static __thread tcache_bin_t tcache[TCACHE_BINS_NUM];
+static __thread realloc_growth_t realloc_growths[REALLOC_TRACKED];
+static __thread intptr_t profile_countdown = 0;
+static __thread unsigned int profile_seed = 0;
 
 // Challenge 7
 size_t _8_bit_align(size_t size)
@@ -48,454 +395,2540 @@ size_t _8_bit_align(size_t size)
     return (size % 8 != 0) ? (size & (-8)) + 8 : size; // used to align the blocks
 }
 
+// Requests are rounded up to the sizes the slabs and the heap keep, slots are multiples of
+// PAYLOAD_ALIGNMENT (so a cached slot has room for its link and mark) and blocks of a heap request are
+static size_t _align_size(size_t size)
+{
+    if (size > SIZE_LIMIT) {
+        return size; // rejected by the caller, rounding it could wrap
+    }
+    if (IS_SLAB_SIZE(size)) {
+        return ALIGN_UP(size, PAYLOAD_ALIGNMENT);
+    }
+    return ALIGN_UP(size + HEADER_SIZE, PAYLOAD_ALIGNMENT) - HEADER_SIZE;
+}
+
+size_t _num_arenas()
+{
+    return arenas_num;
+}
+size_t _arena_num_threads(size_t index)
+{
+    return arenas[index].threads_num;
+}
+size_t _arena_num_free_blocks(size_t index)
+{
+    return arenas[index].free_blocks_num;
+}
+size_t _arena_num_free_bytes(size_t index)
+{
+    return arenas[index].free_bytes_num;
+}
+size_t _arena_num_allocated_blocks(size_t index)
+{
+    return arenas[index].allocated_blocks_num;
+}
+size_t _arena_num_allocated_bytes(size_t index)
+{
+    return arenas[index].allocated_bytes_num;
+}
+
 size_t _num_free_blocks()
 {
-    return free_blocks_num;
+    size_t sum = 0;
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        sum += arenas[i].free_blocks_num;
+    }
+    return sum;
 }
 size_t _num_free_bytes()
 {
-    return free_bytes_num;
+    size_t sum = 0;
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        sum += arenas[i].free_bytes_num;
+    }
+    return sum;
 }
 size_t _num_allocated_blocks()
 {
-    return allocated_blocks_num;
+    size_t sum = 0;
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        sum += arenas[i].allocated_blocks_num;
+    }
+    return sum;
 }
 size_t _num_allocated_bytes()
 {
-    return allocated_bytes_num;
+    size_t sum = 0;
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        sum += arenas[i].allocated_bytes_num;
+    }
+    return sum;
 }
 size_t _size_meta_data()
 {
-    // 48 bytes
-    return sizeof(head_metadata_t) + sizeof(tail_metadata_t);
+    // 8 bytes, the links and footer of free blocks live in their payload
+    return HEADER_SIZE;
 }
+
+// A block has to fit the links and the footer once it is free
+static size_t _block_size_of(size_t size)
+{
+    size_t block_size = ALIGN_UP(size + _size_meta_data(), PAYLOAD_ALIGNMENT);
+    return (block_size < MIN_BLOCK_SIZE) ? MIN_BLOCK_SIZE : block_size;
+}
+// Slab slots count as allocated blocks but only their slab headers are meta data
 size_t _num_meta_data_bytes()
 {
-    return _size_meta_data() * allocated_blocks_num;
+    size_t slabs = 0;
+    size_t slots = 0;
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        slabs += arenas[i].slabs_num;
+        slots += arenas[i].slab_slots_num;
+    }
+    return _size_meta_data() * (_num_allocated_blocks() - slots) + sizeof(slab_t) * slabs;
+}
+
+size_t _num_mmap_cache_hits()
+{
+    return mmap_cache.hits;
+}
+
+size_t _num_mmap_cache_misses()
+{
+    return mmap_cache.misses;
+}
+
+size_t _num_mmap_cache_bytes()
+{
+    return mmap_cache.bytes;
+}
+
+// Releases the physical pages that are entirely inside of [from, to), returns true if there were any
+static bool _release_pages(void* from, void* to)
+{
+    uintptr_t start = ((uintptr_t)from + OS_PAGE_SIZE - 1) & ~((uintptr_t)OS_PAGE_SIZE - 1);
+    uintptr_t end = (uintptr_t)to & ~((uintptr_t)OS_PAGE_SIZE - 1);
+    if (start >= end) {
+        return false;
+    }
+    return madvise((void*)start, end - start, MADV_DONTNEED) == 0;
 }
 
-void* _sbrk(intptr_t delta)
+// Maps length bytes at a THP_SIZE boundary, the address space mapped around it for the alignment is
+// unmapped again
+static void* _thp_mmap(size_t length, int prot, int flags)
 {
-    static void* program_break = sbrk(0);
-    if ((size_t)program_break % 8 != 0) {
-        sbrk(8 - (size_t)program_break % 8);
-        program_break = sbrk(0);
+    length = PAGE_ROUND_UP(length);
+    size_t mapped_length = length + THP_SIZE - OS_PAGE_SIZE;
+    uint8_t* mapping = (uint8_t*)mmap(nullptr, mapped_length, prot, flags, -1, 0);
+    if (mapping == (void*)(-1)) {
+        return mapping;
+    }
+    uint8_t* start = (uint8_t*)(((uintptr_t)mapping + THP_SIZE - 1) & ~((uintptr_t)THP_SIZE - 1));
+    if (start > mapping) {
+        munmap(mapping, start - mapping);
     }
-    if (delta == 0) {
-        return program_break;
+    if (start + length < mapping + mapped_length) {
+        munmap(start + length, mapping + mapped_length - (start + length));
+    }
+    madvise(start, length, (thp_enabled) ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+    return start;
+}
+
+// Every arena heap is a PROT_NONE reservation that is made writable HEAP_COMMIT_SIZE bytes at a time
+// as its break passes heap_committed, so moving the break is a pointer bump most of the time. Pages
+// above a lowered break are released but stay committed
+static void* _heap_sbrk(arena_t* arena, intptr_t delta)
+{
+    if (arena->heap_end == nullptr) {
+        // Not MAP_NORESERVE, the committed part is accounted for so running out of memory fails the
+        // mprotect instead of a page fault later
+        void* heap = _thp_mmap(ARENA_HEAP_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS);
+        if (heap == (void*)(-1)) {
+            return heap;
+        }
+#ifdef MALLOC4_SIDE_TABLE
+        void* side_table = mmap(nullptr, SIDE_TABLE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (side_table == (void*)(-1)) {
+            munmap(heap, ARENA_HEAP_SIZE);
+            return side_table;
+        }
+        arena->side_table = (side_chunk_t*)side_table;
+#endif
+        arena->heap_break = (uint8_t*)heap + BLOCK_OFFSET;
+        arena->heap_committed = heap;
+        arena->heap_end = (void*)((uint8_t*)heap + ARENA_HEAP_SIZE);
     }
-    void* sbrk_break = sbrk(0);
-    if (sbrk_break == (void*)(-1)) {
-        return sbrk_break;
+    uint8_t* new_break = (uint8_t*)arena->heap_break + delta;
+    if (new_break > (uint8_t*)arena->heap_end) {
+        return (void*)(-1);
     }
-    if ((intptr_t)program_break + delta > (intptr_t)sbrk_break) {
-        sbrk_break = sbrk((intptr_t)program_break + delta - (intptr_t)sbrk_break);
-        if (sbrk_break == (void*)(-1)) {
-            return sbrk_break;
+    if (new_break > (uint8_t*)arena->heap_committed) {
+        uint8_t* committed = (uint8_t*)HEAP_COMMIT_ROUND_UP((uintptr_t)new_break);
+        if (mprotect(arena->heap_committed, committed - (uint8_t*)arena->heap_committed, PROT_READ | PROT_WRITE) != 0) {
+            return (void*)(-1);
         }
+        arena->heap_committed = committed;
+    }
+    void* prev_break = arena->heap_break;
+    arena->heap_break = new_break;
+    // The break is only lowered to BLOCK_OFFSET bytes short of a page boundary, they are cleared and
+    // the pages above released so everything above it is zero again
+    if (delta < 0) {
+        uint8_t* page = (uint8_t*)PAGE_ROUND_UP((uintptr_t)new_break);
+        memset(new_break, 0, page - new_break);
+        _release_pages(page, (void*)PAGE_ROUND_UP((uintptr_t)prev_break));
     }
-    void* prev_break = program_break;
-    program_break = (void*)((intptr_t)program_break + delta);
     return prev_break;
 }
 
-// has to be set after setting block head metadata
-static void _set_tail(head_metadata_t* block)
+#if MALLOC4_CHECK_LEVEL > CHECK_NONE
+static void _init_cookie()
 {
-    if (global_rand_cookie == 0) {
-        srand(time(nullptr));
-    }
-    while (global_rand_cookie == 0) {
+    srand(time(nullptr));
+    while ((global_rand_cookie & COOKIE_MASK) == 0) {
         global_rand_cookie = rand();
     }
-    tail_metadata_t* tail = TAIL_METADATA(block);
-    tail->cookie = global_rand_cookie;
-    tail->size = block->size;
+    // Odd so it is never a block address
+    cached_mark = ((uintptr_t)rand() << 32) ^ ((uintptr_t)rand() << 1) ^ 1;
+}
+#endif
+
+// Every block belongs to an arena so the cookie was seeded by _init_arenas before any header is set
+static void _set_header(head_metadata_t* block, size_t block_size, uint32_t arena, uint64_t flags)
+{
+    uint64_t header = block_size | flags | ((uint64_t)arena << ARENA_SHIFT);
+#if MALLOC4_CHECK_LEVEL > CHECK_NONE
+    header |= (uint64_t)(global_rand_cookie & COOKIE_MASK) << COOKIE_SHIFT;
+#endif
+    __atomic_store_n(&block->header, header, __ATOMIC_RELAXED);
+}
+
+// Headers are only written under the arena lock so a plain store is enough
+static void _set_flags(head_metadata_t* block, uint64_t header)
+{
+    __atomic_store_n(&block->header, header, __ATOMIC_RELAXED);
+}
+
+// keeps the flags of the block
+static void _resize_block(head_metadata_t* block, size_t block_size)
+{
+    _set_flags(block, (HEADER(block) & ~SIZE_MASK) | block_size);
 }
 
 // Challenge 5
-static void _check_cookie(head_metadata_t* block)
+#if MALLOC4_CHECK_LEVEL > CHECK_NONE
+static void _verify_cookie(head_metadata_t* block)
 {
-    tail_metadata_t* tail = TAIL_METADATA(block);
-    if (global_rand_cookie != 0 && global_rand_cookie != tail->cookie) {
+    if (global_rand_cookie != 0 && (HEADER(block) >> COOKIE_SHIFT) != (global_rand_cookie & COOKIE_MASK)) {
         exit(0xdeadbeef);
     }
 }
+#endif
+
+// Checks a block the heap walks over
+static inline void _check_cookie(head_metadata_t* block)
+{
+#if MALLOC4_CHECK_LEVEL >= CHECK_FULL
+    _verify_cookie(block);
+#else
+    (void)block;
+#endif
+}
+
+// Checks the block given to sfree, returns false if it is already free
+static inline bool _check_freed_block(head_metadata_t* block)
+{
+#if MALLOC4_CHECK_LEVEL >= CHECK_FREE
+    _verify_cookie(block);
+    return !IS_FREE(block) && block->prev != CACHED_MARK;
+#else
+    (void)block;
+    return true;
+#endif
+}
+
+// Checks the slab slot given to sfree, returns false if it is free in its slab or cached. The bitmap
+// is owned by the slab's arena so it is only read here
+static inline bool _check_freed_slot(void* p)
+{
+#if MALLOC4_CHECK_LEVEL >= CHECK_FREE
+    slab_t* slab = SLAB_OF(p);
+    size_t slot = ((uint8_t*)p - SLAB_SLOTS(slab)) / slab->slot_size;
+    uint64_t bitmap = __atomic_load_n(&slab->free_bitmap[slot / 64], __ATOMIC_RELAXED);
+    return !(bitmap & ((uint64_t)1 << (slot % 64))) && BLOCK_OF(p)->prev != CACHED_MARK;
+#else
+    (void)p;
+    return true;
+#endif
+}
+
+// Checks the size given to sfree_sized, returns false if the slot or block at p can't hold it. The
+// thread cache would hand it out again for that size
+static inline bool _check_freed_size(void* p, size_t size)
+{
+#if MALLOC4_CHECK_LEVEL >= CHECK_FREE
+    size_t usable = (IS_SLAB_PTR(p)) ? SLAB_OF(p)->slot_size : BLOCK_SIZE(BLOCK_OF(p)) - HEADER_SIZE;
+    return size <= usable;
+#else
+    (void)p;
+    (void)size;
+    return true;
+#endif
+}
+
+#ifdef MALLOC4_SIDE_TABLE
+static void _set_side_free(arena_t* arena, head_metadata_t* block, bool free)
+{
+    size_t granule = ((uint8_t*)block - HEAP_START(arena)) / 8;
+    side_chunk_t* chunk = &arena->side_table[granule / SIDE_CHUNK_GRANULES];
+    size_t word = granule % SIDE_CHUNK_GRANULES / 64;
+    if (free) {
+        chunk->free_bitmap[word] |= (uint64_t)1 << (granule % 64);
+        chunk->words_mask[word / 64] |= (uint64_t)1 << (word % 64);
+        return;
+    }
+    chunk->free_bitmap[word] &= ~((uint64_t)1 << (granule % 64));
+    if (chunk->free_bitmap[word] == 0) {
+        chunk->words_mask[word / 64] &= ~((uint64_t)1 << (word % 64));
+    }
+}
+#endif
+
+// Whether a block of the heap is free, the side table answers without touching the block
+static inline bool _is_sbrk_free(arena_t* arena, head_metadata_t* block)
+{
+#ifdef MALLOC4_SIDE_TABLE
+    size_t granule = ((uint8_t*)block - HEAP_START(arena)) / 8;
+    side_chunk_t* chunk = &arena->side_table[granule / SIDE_CHUNK_GRANULES];
+    return chunk->free_bitmap[granule % SIDE_CHUNK_GRANULES / 64] & ((uint64_t)1 << (granule % 64));
+#else
+    (void)arena;
+    return IS_FREE(block);
+#endif
+}
+
+// Updates PREV_FREE of the block after block, the heap break has its flag in the arena
+static void _set_next_prev_free(arena_t* arena, head_metadata_t* block, bool prev_free)
+{
+    head_metadata_t* next = NEXT_BLOCK(block);
+    if ((void*)next == arena->heap_break) {
+        arena->break_prev_free = prev_free;
+    } else if (prev_free) {
+        _set_flags(next, HEADER(next) | PREV_FREE_BIT);
+    } else {
+        _set_flags(next, HEADER(next) & ~PREV_FREE_BIT);
+    }
+}
 
-static head_metadata_t* _init_sbrk_alloc_block(head_metadata_t* block, size_t block_size, bool alloc)
+// A new block at the break starts with no flags, an existing one keeps PREV_FREE
+static head_metadata_t* _init_sbrk_alloc_block(arena_t* arena, head_metadata_t* block, size_t block_size, bool alloc)
 {
     if (alloc) {
-        if (_sbrk(block_size) == (void*)(-1)) {
+        if (_heap_sbrk(arena, block_size) == (void*)(-1)) {
             return nullptr;
         }
+        _set_header(block, block_size, arena->index, 0);
+        return block;
     }
-    block->size = block_size;
-    block->is_free = false;
-    block->next = nullptr;
-    block->prev = nullptr;
-    _set_tail(block);
+    _set_header(block, block_size, arena->index, HEADER(block) & PREV_FREE_BIT);
     return block;
 }
 
-static head_metadata_t* _wilderness_sbrk_block_increase(head_metadata_t* wilderness, size_t block_size)
+static head_metadata_t* _wilderness_sbrk_block_increase(arena_t* arena, head_metadata_t* wilderness, size_t block_size)
 {
-    size_t delta = block_size - wilderness->size;
-    if (_sbrk(delta) == (void*)(-1)) {
+    size_t delta = block_size - BLOCK_SIZE(wilderness);
+    if (_heap_sbrk(arena, delta) == (void*)(-1)) {
         return nullptr;
     }
-    wilderness->size = block_size;
-    _set_tail(wilderness);
+    _resize_block(wilderness, block_size);
     return wilderness;
 }
 
-// returns the best fit free block if not found returns nullptr
-static head_metadata_t* _find_sbrk_free_block(size_t block_size)
+static size_t _bin_index(size_t block_size)
 {
-    head_metadata_t* min = nullptr;
-    head_metadata_t* wilderness = nullptr;
-    if (sbrk_free_head == nullptr) {
-        return nullptr;
+    if (block_size < EXACT_BINS_LIMIT) {
+        return block_size / 8;
     }
-    void* program_break = _sbrk(0);
-    for (head_metadata_t* current = sbrk_free_head; current != nullptr; current = current->next) {
-        _check_cookie(current);
-        // Challenge 0
-        if (current->size >= block_size && (min == nullptr || min->size > current->size)) {
-            min = current;
-        }
-        // Challenge 3
-        if ((void*)((uint8_t*)current + current->size) == program_break) {
-            wilderness = current;
-        }
+    size_t msb = 63 - __builtin_clzll(block_size);
+    size_t index = EXACT_BINS_NUM + ((msb - 10) << LOG_BINS_SHIFT) + ((block_size >> (msb - LOG_BINS_SHIFT)) & ((1 << LOG_BINS_SHIFT) - 1));
+    return (index < BINS_NUM) ? index : BINS_NUM - 1;
+}
+
+// returns the first non empty bin starting from index, BINS_NUM if there is none
+static size_t _next_nonempty_bin(arena_t* arena, size_t index)
+{
+    size_t word = index / 64;
+    if (word >= BITMAP_WORDS) {
+        return BINS_NUM;
     }
-    if (min != nullptr) {
-        return min;
+    uint64_t bits = arena->bins_bitmap[word] & (~(uint64_t)0 << (index % 64));
+    while (bits == 0) {
+        if (++word == BITMAP_WORDS) {
+            return BINS_NUM;
+        }
+        bits = arena->bins_bitmap[word];
     }
-    if (wilderness != nullptr) {
-        free_bytes_num += block_size - wilderness->size;
-        allocated_bytes_num += block_size - wilderness->size;
-        return _wilderness_sbrk_block_increase(wilderness, block_size);
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+static uint32_t _treap_priority(head_metadata_t* block)
+{
+    return ((uintptr_t)block * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static bool _is_block_before(head_metadata_t* block, head_metadata_t* other)
+{
+    size_t block_size = BLOCK_SIZE(block);
+    size_t other_size = BLOCK_SIZE(other);
+    return block_size < other_size || (block_size == other_size && block < other);
+}
+
+// splits the tree to the blocks before key and the blocks after it
+static void _treap_split(head_metadata_t* root, head_metadata_t* key, head_metadata_t** left, head_metadata_t** right)
+{
+    while (root != nullptr) {
+        _check_cookie(root);
+        if (_is_block_before(root, key)) {
+            *left = root;
+            left = &root->next;
+            root = root->next;
+        } else {
+            *right = root;
+            right = &root->prev;
+            root = root->prev;
+        }
     }
-    return nullptr;
+    *left = nullptr;
+    *right = nullptr;
 }
 
-static void _add_sbrk_free_block(head_metadata_t* block)
+// joins two trees when all the blocks of left are before the blocks of right
+static head_metadata_t* _treap_merge(head_metadata_t* left, head_metadata_t* right)
 {
-    block->is_free = true;
-    block->prev = nullptr;
-    if (sbrk_free_head == nullptr || block->size < sbrk_free_head->size || (block->size == sbrk_free_head->size && block < sbrk_free_head)) {
-        head_metadata_t* temp = sbrk_free_head;
-        sbrk_free_head = block;
-        block->next = temp;
-        if (temp) {
-            temp->prev = block;
+    head_metadata_t* root;
+    head_metadata_t** link = &root;
+    while (left != nullptr && right != nullptr) {
+        if (_treap_priority(left) > _treap_priority(right)) {
+            *link = left;
+            link = &left->next;
+            left = left->next;
+        } else {
+            *link = right;
+            link = &right->prev;
+            right = right->prev;
         }
-        return;
     }
-    head_metadata_t* current;
-    _check_cookie(sbrk_free_head);
-    for (current = sbrk_free_head; current->next != nullptr; current = current->next) {
-        head_metadata_t* next = current->next;
-        _check_cookie(next);
-        if (block->size < next->size || (block->size == next->size && block < next)) {
-            block->prev = current;
-            block->next = next;
-            next->prev = block;
-            current->next = block;
-            return;
+    *link = (left != nullptr) ? left : right;
+    return root;
+}
+
+// returns the first block of at least block_size, the lowest address first among equal sizes
+static head_metadata_t* _treap_lower_bound(head_metadata_t* root, size_t block_size)
+{
+    head_metadata_t* best = nullptr;
+    while (root != nullptr) {
+        _check_cookie(root);
+        if (BLOCK_SIZE(root) >= block_size) {
+            best = root;
+            root = root->prev;
+        } else {
+            root = root->next;
         }
     }
-    block->prev = current;
-    block->next = nullptr;
-    current->next = block;
+    return best;
 }
 
-static void _remove_sbrk_free_block(head_metadata_t* block)
+static void _add_sbrk_free_block(arena_t* arena, head_metadata_t* block)
 {
-    block->is_free = false;
-    if (sbrk_free_head == block) {
-        sbrk_free_head = block->next;
-        block->next = nullptr;
+    size_t block_size = BLOCK_SIZE(block);
+    size_t index = _bin_index(block_size);
+    _set_flags(block, HEADER(block) | FREE_BIT);
+#ifdef MALLOC4_SIDE_TABLE
+    _set_side_free(arena, block, true);
+#endif
+    FOOTER(NEXT_BLOCK(block)) = block_size;
+    _set_next_prev_free(arena, block, true);
+    arena->bins_bitmap[index / 64] |= (uint64_t)1 << (index % 64);
+    head_metadata_t* head = arena->free_bins[index];
+    if (index < EXACT_BINS_NUM) {
+        arena->free_bins[index] = block;
         block->prev = nullptr;
+        block->next = head;
+        if (head) {
+            head->prev = block;
+        }
         return;
     }
-    head_metadata_t* prev = block->prev;
-    head_metadata_t* next = block->next;
-    if (prev) {
-        _check_cookie(prev);
-        prev->next = next;
+    head_metadata_t** link = &arena->free_bins[index];
+    uint32_t priority = _treap_priority(block);
+    while (*link != nullptr && _treap_priority(*link) > priority) {
+        _check_cookie(*link);
+        link = _is_block_before(block, *link) ? &(*link)->prev : &(*link)->next;
+    }
+    _treap_split(*link, block, &block->prev, &block->next);
+    *link = block;
+}
+
+static void _remove_sbrk_free_block(arena_t* arena, head_metadata_t* block)
+{
+    _set_flags(block, HEADER(block) & ~(FREE_BIT | ZEROED_BIT));
+#ifdef MALLOC4_SIDE_TABLE
+    _set_side_free(arena, block, false);
+#endif
+    _set_next_prev_free(arena, block, false);
+    size_t index = _bin_index(BLOCK_SIZE(block));
+    if (index >= EXACT_BINS_NUM) {
+        head_metadata_t** link = &arena->free_bins[index];
+        while (*link != block) {
+            _check_cookie(*link);
+            link = _is_block_before(block, *link) ? &(*link)->prev : &(*link)->next;
+        }
+        *link = _treap_merge(block->prev, block->next);
+    } else if (arena->free_bins[index] == block) {
+        arena->free_bins[index] = block->next;
+        if (block->next) {
+            _check_cookie(block->next);
+            block->next->prev = nullptr;
+        }
+    } else {
+        _check_cookie(block->prev);
+        block->prev->next = block->next;
+        if (block->next) {
+            _check_cookie(block->next);
+            block->next->prev = block->prev;
+        }
     }
-    if (next) {
-        _check_cookie(next);
-        next->prev = prev;
+    if (arena->free_bins[index] == nullptr) {
+        arena->bins_bitmap[index / 64] &= ~((uint64_t)1 << (index % 64));
     }
     block->next = nullptr;
     block->prev = nullptr;
 }
 
-static void _init_sbrk_free_block(head_metadata_t* block, size_t block_size)
+// Challenge 3
+static head_metadata_t* _get_sbrk_wilderness(arena_t* arena)
 {
-    block->size = block_size;
-    block->next = nullptr;
-    block->prev = nullptr;
-    _set_tail(block);
-    _add_sbrk_free_block(block);
+    if (!arena->break_prev_free) {
+        return nullptr;
+    }
+    head_metadata_t* wilderness = (head_metadata_t*)((uint8_t*)arena->heap_break - FOOTER(arena->heap_break));
+    _check_cookie(wilderness);
+    return wilderness;
+}
+
+// returns the best fit free block if not found returns nullptr
+static head_metadata_t* _find_sbrk_free_block(arena_t* arena, size_t block_size)
+{
+    size_t index = _bin_index(block_size);
+    // Challenge 0
+    head_metadata_t* best = arena->free_bins[index];
+    if (index >= EXACT_BINS_NUM) {
+        best = _treap_lower_bound(best, block_size);
+    } else if (best != nullptr) {
+        _check_cookie(best);
+    }
+    if (best != nullptr) {
+        return best;
+    }
+    index = _next_nonempty_bin(arena, index + 1);
+    if (index < BINS_NUM) {
+        // The smallest block of a log bin is its leftmost one
+        best = arena->free_bins[index];
+        _check_cookie(best);
+        while (index >= EXACT_BINS_NUM && best->prev != nullptr) {
+            best = best->prev;
+            _check_cookie(best);
+        }
+        return best;
+    }
+    head_metadata_t* wilderness = _get_sbrk_wilderness(arena);
+    if (wilderness == nullptr) {
+        return nullptr;
+    }
+    // The bin depends on the size so the block is re-added after the increase, the old footer ends up
+    // inside of it
+    size_t delta = block_size - BLOCK_SIZE(wilderness);
+    uint64_t zeroed = HEADER(wilderness) & ZEROED_BIT;
+    _remove_sbrk_free_block(arena, wilderness);
+    FOOTER(arena->heap_break) = 0;
+    head_metadata_t* increased = _wilderness_sbrk_block_increase(arena, wilderness, block_size);
+    _add_sbrk_free_block(arena, wilderness);
+    _set_flags(wilderness, HEADER(wilderness) | zeroed);
+    if (increased == nullptr) {
+        return nullptr;
+    }
+    arena->free_bytes_num += delta;
+    arena->allocated_bytes_num += delta;
+    return increased;
+}
+
+// The block before it is allocated
+static void _init_sbrk_free_block(arena_t* arena, head_metadata_t* block, size_t block_size, uint64_t flags = 0)
+{
+    _set_header(block, block_size, arena->index, flags);
+    _add_sbrk_free_block(arena, block);
 }
 
 // Challenge 2
-static head_metadata_t* _merge_sbrk_blocks(head_metadata_t* block, bool merge_left = true, bool merge_right = true, bool copy_data = false)
+static head_metadata_t* _merge_sbrk_blocks(arena_t* arena, head_metadata_t* block, bool merge_left = true, bool merge_right = true, bool copy_data = false)
 {
-    size_t block_size_sum = block->size;
+    size_t block_size_sum = BLOCK_SIZE(block);
     head_metadata_t* returned_block = block;
     head_metadata_t* left_block = nullptr;
     head_metadata_t* right_block = nullptr;
-    if (merge_left && sbrk_head != block) {
-        size_t prev_block_size = ((tail_metadata_t*)((uint8_t*)block - sizeof(tail_metadata_t)))->size;
-        left_block = (head_metadata_t*)((uint8_t*)block - prev_block_size);
+    if (merge_left && IS_PREV_FREE(block)) {
+        left_block = (head_metadata_t*)((uint8_t*)block - FOOTER(block));
         _check_cookie(left_block);
     }
-    if (merge_right && (void*)((uint8_t*)block + block->size) != _sbrk(0)) {
-        right_block = (head_metadata_t*)((uint8_t*)block + block->size);
+    if (merge_right && (void*)NEXT_BLOCK(block) != arena->heap_break && _is_sbrk_free(arena, NEXT_BLOCK(block))) {
+        right_block = NEXT_BLOCK(block);
         _check_cookie(right_block);
     }
-    if (left_block && left_block->is_free) {
+    if (left_block && IS_FREE(left_block)) {
         returned_block = left_block;
-        block_size_sum += left_block->size;
-        free_blocks_num--;
-        allocated_blocks_num--;
-        free_bytes_num -= left_block->size - _size_meta_data();
-        allocated_bytes_num += _size_meta_data();
-        _remove_sbrk_free_block(left_block);
+        block_size_sum += BLOCK_SIZE(left_block);
+        arena->free_blocks_num--;
+        arena->allocated_blocks_num--;
+        arena->free_bytes_num -= BLOCK_SIZE(left_block) - _size_meta_data();
+        arena->allocated_bytes_num += _size_meta_data();
+        _remove_sbrk_free_block(arena, left_block);
         if (copy_data) {
-            memmove((void*)((uint8_t*)left_block + sizeof(head_metadata_t)), (void*)((uint8_t*)block + sizeof(head_metadata_t)), block->size - _size_meta_data());
+            memmove(PAYLOAD_OF(left_block), PAYLOAD_OF(block), BLOCK_SIZE(block) - _size_meta_data());
         }
     }
-    if (right_block && right_block->is_free) {
-        block_size_sum += right_block->size;
-        free_blocks_num--;
-        allocated_blocks_num--;
-        free_bytes_num -= right_block->size - _size_meta_data();
-        allocated_bytes_num += _size_meta_data();
-        _remove_sbrk_free_block(right_block);
+    if (right_block) {
+        block_size_sum += BLOCK_SIZE(right_block);
+        arena->free_blocks_num--;
+        arena->allocated_blocks_num--;
+        arena->free_bytes_num -= BLOCK_SIZE(right_block) - _size_meta_data();
+        arena->allocated_bytes_num += _size_meta_data();
+        _remove_sbrk_free_block(arena, right_block);
     }
-    return _init_sbrk_alloc_block(returned_block, block_size_sum, false);
+    return _init_sbrk_alloc_block(arena, returned_block, block_size_sum, false);
 }
 
-static head_metadata_t* _sbrk_malloc(size_t block_size)
+// zeroed is set if the payload is known to be zero but for the footer at its end
+static head_metadata_t* _sbrk_malloc(arena_t* arena, size_t block_size, bool* zeroed = nullptr)
 {
     head_metadata_t* last_block;
-    if (sbrk_head) {
-        head_metadata_t* last_searched = _find_sbrk_free_block(block_size);
+    if (arena->sbrk_head) {
+        head_metadata_t* last_searched = _find_sbrk_free_block(arena, block_size);
         if (last_searched) {
-            free_blocks_num--;
-            free_bytes_num -= last_searched->size - _size_meta_data();
-            _remove_sbrk_free_block(last_searched);
+            uint64_t known_zero = HEADER(last_searched) & ZEROED_BIT;
+            if (zeroed) {
+                *zeroed = known_zero;
+            }
+            arena->free_blocks_num--;
+            arena->free_bytes_num -= BLOCK_SIZE(last_searched) - _size_meta_data();
+            _remove_sbrk_free_block(arena, last_searched);
             // Challenge 1
             if (IS_REDUNDANT(last_searched, block_size)) {
-                free_blocks_num++;
-                free_bytes_num += last_searched->size - _size_meta_data() - block_size;
-                allocated_blocks_num++;
-                allocated_bytes_num -= _size_meta_data();
-                size_t prev_size = last_searched->size;
-                _init_sbrk_alloc_block(last_searched, block_size, false);
-                _init_sbrk_free_block((head_metadata_t*)((uint8_t*)last_searched + block_size), prev_size - block_size);
+                arena->free_blocks_num++;
+                arena->free_bytes_num += BLOCK_SIZE(last_searched) - _size_meta_data() - block_size;
+                arena->allocated_blocks_num++;
+                arena->allocated_bytes_num -= _size_meta_data();
+                size_t prev_size = BLOCK_SIZE(last_searched);
+                _init_sbrk_alloc_block(arena, last_searched, block_size, false);
+                _init_sbrk_free_block(arena, (head_metadata_t*)((uint8_t*)last_searched + block_size), prev_size - block_size, known_zero);
             }
             return last_searched;
         }
     } else {
-        sbrk_head = (head_metadata_t*)_sbrk(0);
-        if (sbrk_head == (head_metadata_t*)(-1)) {
-            sbrk_head = nullptr;
+        arena->sbrk_head = (head_metadata_t*)_heap_sbrk(arena, 0);
+        if (arena->sbrk_head == (head_metadata_t*)(-1)) {
+            arena->sbrk_head = nullptr;
             return nullptr;
         }
     }
-    last_block = (head_metadata_t*)_sbrk(0);
-    last_block = _init_sbrk_alloc_block(last_block, block_size, true);
-    allocated_blocks_num++;
-    allocated_bytes_num += block_size - _size_meta_data();
+    last_block = (head_metadata_t*)_heap_sbrk(arena, 0);
+    last_block = _init_sbrk_alloc_block(arena, last_block, block_size, true);
+    if (last_block == nullptr) {
+        return nullptr;
+    }
+    arena->allocated_blocks_num++;
+    arena->allocated_bytes_num += block_size - _size_meta_data();
+    if (zeroed) {
+        *zeroed = true;
+    }
     return last_block;
 }
 
-// Challenge 4
-static head_metadata_t* _mmap_malloc(size_t block_size, bool force_hugepage = false)
+static uint64_t _now_ns()
 {
-    // Challenge 6
-    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
-    flags |= (force_hugepage || block_size >= HUGE_PAGE_LIMIT) ? MAP_HUGETLB : 0;
-    void* mmap_addr = mmap(nullptr, block_size, PROT_READ | PROT_WRITE, flags, -1, 0);
-    if (mmap_addr == (void*)(-1)) {
-        return nullptr;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000 * 1000 * 1000 + now.tv_nsec;
+}
+
+// Has to be called with the cache lock held
+static void _unmap_cached_chunk(size_t index)
+{
+    mmap_chunk_t* chunk = &mmap_cache.chunks[index];
+    munmap(chunk->chunk, chunk->length);
+    mmap_cache.bytes -= chunk->length;
+    *chunk = mmap_cache.chunks[--mmap_cache.chunks_num];
+}
+
+// Has to be called with the cache lock held
+static void _expire_mmap_cache(uint64_t now)
+{
+    for (size_t i = 0; i < mmap_cache.chunks_num;) {
+        if (now - mmap_cache.chunks[i].freed_at >= MMAP_CACHE_MAX_AGE) {
+            _unmap_cached_chunk(i);
+        } else {
+            i++;
+        }
+    }
+}
+
+// Takes the smallest cached chunk that fits length with little enough slack, its length is returned
+// in cached_length
+static void* _mmap_cache_get(size_t length, size_t* cached_length)
+{
+    pthread_mutex_lock(&mmap_cache.lock);
+    _expire_mmap_cache(_now_ns());
+    mmap_chunk_t* best = nullptr;
+    for (size_t i = 0; i < mmap_cache.chunks_num; i++) {
+        mmap_chunk_t* chunk = &mmap_cache.chunks[i];
+        if (chunk->length >= length && chunk->length <= length + MMAP_CACHE_SLACK(length) && (best == nullptr || chunk->length < best->length)) {
+            best = chunk;
+        }
     }
-    head_metadata_t* block = (head_metadata_t*)mmap_addr;
-    // We use the sbrk function because it fits our needs (we don't call sbrk of course)
-    _init_sbrk_alloc_block(block, block_size, false);
-    if (force_hugepage || block_size >= HUGE_PAGE_LIMIT) {
-        block->next = (head_metadata_t*)HUGE_PAGE;
+    void* mmap_addr = nullptr;
+    if (best) {
+        mmap_addr = best->chunk;
+        *cached_length = best->length;
+        mmap_cache.bytes -= best->length;
+        *best = mmap_cache.chunks[--mmap_cache.chunks_num];
+        mmap_cache.hits++;
     } else {
-        block->next = (head_metadata_t*)REGULAR_PAGE;
+        mmap_cache.misses++;
     }
-    allocated_blocks_num++;
-    allocated_bytes_num += block_size - _size_meta_data();
-    return block;
+    pthread_mutex_unlock(&mmap_cache.lock);
+    return mmap_addr;
 }
 
-void* smalloc(size_t size)
+// Returns false if the chunk can't be cached and has to be unmapped
+static bool _mmap_cache_put(void* mmap_addr, size_t length)
 {
-    head_metadata_t* block;
-    size = _8_bit_align(size);
-    if (size == 0 || size > SIZE_LIMIT) {
-        return nullptr;
+    if (length > MMAP_CACHE_MAX_BYTES) {
+        return false;
     }
-    size_t block_size = size + _size_meta_data();
-    if (ALLOC_SBRK(block_size)) {
-        block = _sbrk_malloc(block_size);
-    } else {
-        block = _mmap_malloc(block_size);
+    pthread_mutex_lock(&mmap_cache.lock);
+    uint64_t now = _now_ns();
+    _expire_mmap_cache(now);
+    while (mmap_cache.chunks_num == MMAP_CACHE_SLOTS || mmap_cache.bytes + length > MMAP_CACHE_MAX_BYTES) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < mmap_cache.chunks_num; i++) {
+            if (mmap_cache.chunks[i].freed_at < mmap_cache.chunks[oldest].freed_at) {
+                oldest = i;
+            }
+        }
+        _unmap_cached_chunk(oldest);
     }
-    return (block) ? (void*)((uint8_t*)block + sizeof(head_metadata_t)) : nullptr;
+    mmap_cache.chunks[mmap_cache.chunks_num++] = { mmap_addr, length, now };
+    mmap_cache.bytes += length;
+    pthread_mutex_unlock(&mmap_cache.lock);
+    return true;
 }
 
-void* scalloc(size_t num, size_t size)
+// Unmaps every cached chunk, returns true if there were any
+static bool _flush_mmap_cache()
 {
-    void* alloc;
-    size = _8_bit_align(num * size);
-    if (size == 0 || size > SIZE_LIMIT) {
-        return nullptr;
+    pthread_mutex_lock(&mmap_cache.lock);
+    bool released = mmap_cache.chunks_num != 0;
+    while (mmap_cache.chunks_num != 0) {
+        _unmap_cached_chunk(0);
     }
-    size_t block_size = size + _size_meta_data();
-    if (block_size > SCALLOC_HUGE_PAGE_LIMIT + _size_meta_data()) {
-        head_metadata_t* block = _mmap_malloc(block_size, true);
-        if (block == nullptr) {
-            return nullptr;
+    pthread_mutex_unlock(&mmap_cache.lock);
+    return released;
+}
+
+// Challenge 4
+// Only a fresh mapping is zeroed, a cached chunk still holds what was written to it
+static head_metadata_t* _mmap_malloc(arena_t* arena, size_t block_size, bool force_hugepage = false, bool* zeroed = nullptr)
+{
+    // Challenge 6
+    uint64_t huge_page = (force_hugepage || block_size >= HUGE_PAGE_LIMIT) ? HUGE_PAGE_BIT : 0;
+    size_t length = BLOCK_OFFSET + block_size;
+    void* mmap_addr = nullptr;
+    if (!huge_page) {
+        size_t cached_length;
+        mmap_addr = _mmap_cache_get(PAGE_ROUND_UP(length), &cached_length);
+        // A bigger chunk is taken whole so freeing it unmaps all of it
+        if (mmap_addr && cached_length != PAGE_ROUND_UP(length)) {
+            block_size = cached_length - BLOCK_OFFSET;
         }
-        alloc = (void*)((uint8_t*)block + sizeof(head_metadata_t));
-    } else {
-        alloc = smalloc(size);
     }
-    if (alloc == nullptr) {
-        return nullptr;
+    if (mmap_addr == nullptr) {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        flags |= (huge_page) ? MAP_HUGETLB : 0;
+        mmap_addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+        // Without reserved huge pages the block falls back to transparent huge pages. A scalloc block
+        // is often a sparse table that would zero 2MB on every first touch, it gets regular pages
+        if (mmap_addr == (void*)(-1) && huge_page) {
+            huge_page = 0;
+            mmap_addr = (zeroed) ? mmap(nullptr, length, PROT_READ | PROT_WRITE, flags & ~MAP_HUGETLB, -1, 0) : _thp_mmap(length, PROT_READ | PROT_WRITE, flags & ~MAP_HUGETLB);
+        }
+        if (mmap_addr == (void*)(-1)) {
+            return nullptr;
+        }
+        if (zeroed) {
+            *zeroed = true;
+        }
+    } else if (zeroed) {
+        *zeroed = false;
     }
-    memset(alloc, 0, size);
-    return alloc;
+    head_metadata_t* block = (head_metadata_t*)((uint8_t*)mmap_addr + BLOCK_OFFSET);
+    _set_header(block, block_size, arena->index, MMAPPED_BIT | huge_page);
+    pthread_mutex_lock(&arena->lock);
+    arena->allocated_blocks_num++;
+    arena->allocated_bytes_num += block_size - _size_meta_data();
+    pthread_mutex_unlock(&arena->lock);
+    return block;
 }
 
-void _sbrk_free(head_metadata_t* block)
+// Challenge 4
+// The kernel moves the page tables of the mapping instead of copying it. Huge page mappings are left
+// out, their length must stay a multiple of the huge page size
+static head_metadata_t* _mmap_remap(head_metadata_t* block, size_t block_size)
 {
-    block = _merge_sbrk_blocks(block);
-    free_blocks_num++;
-    free_bytes_num += block->size - _size_meta_data();
-    _add_sbrk_free_block(block);
+    arena_t* arena = BLOCK_ARENA(block);
+    size_t old_block_size = BLOCK_SIZE(block);
+    uint8_t* start = MMAP_START(block);
+    size_t offset = (uint8_t*)block - start;
+    void* mremap_addr = mremap(start, MMAP_END(block) - start, PAGE_ROUND_UP(offset + block_size), MREMAP_MAYMOVE);
+    if (mremap_addr == MAP_FAILED) {
+        return nullptr;
+    }
+    block = (head_metadata_t*)((uint8_t*)mremap_addr + offset);
+    _set_header(block, block_size, arena->index, MMAPPED_BIT);
+    pthread_mutex_lock(&arena->lock);
+    arena->allocated_bytes_num += block_size - old_block_size;
+    pthread_mutex_unlock(&arena->lock);
+    return block;
 }
 
-void _mmap_free(head_metadata_t* block_to_free)
+// Only the part of the free block between from and to is released, the links at its start and the
+// footer at its end stay
+static bool _release_free_block(head_metadata_t* block, void* from, void* to)
 {
-    allocated_blocks_num--;
-    allocated_bytes_num -= block_to_free->size - _size_meta_data();
-    munmap((void*)block_to_free, block_to_free->size);
+    uint8_t* start = (uint8_t*)block + sizeof(head_metadata_t);
+    uint8_t* end = (uint8_t*)NEXT_BLOCK(block) - sizeof(size_t);
+    return _release_pages(((uint8_t*)from > start) ? from : start, ((uint8_t*)to < end) ? to : end);
 }
 
-void sfree(void* p)
+// Like _release_free_block but the part of the range around the released pages is zeroed as well, so
+// the block is ZEROED if the rest of it already was zero. Returns true if any pages were released
+static bool _release_sbrk_free_block(head_metadata_t* block, void* from, void* to)
 {
-    if (p == nullptr) {
-        return;
-    }
-    head_metadata_t* block_to_free = (head_metadata_t*)((uint8_t*)p - sizeof(head_metadata_t));
-    _check_cookie(block_to_free);
-    if (block_to_free->is_free) {
-        return;
+    uint8_t* start = (uint8_t*)block + sizeof(head_metadata_t);
+    uint8_t* end = (uint8_t*)NEXT_BLOCK(block) - sizeof(size_t);
+    start = ((uint8_t*)from > start) ? (uint8_t*)from : start;
+    end = ((uint8_t*)to < end) ? (uint8_t*)to : end;
+    if (IS_ZEROED(block) || start >= end) {
+        return false;
     }
-    if (IS_SBRK_ALLOC(block_to_free)) {
-        _sbrk_free(block_to_free);
+    uint8_t* first_page = (uint8_t*)PAGE_ROUND_UP((uintptr_t)start);
+    uint8_t* last_page = (uint8_t*)((uintptr_t)end & ~((uintptr_t)OS_PAGE_SIZE - 1));
+    bool released = first_page < last_page && _release_pages(first_page, last_page);
+    if (released) {
+        memset(start, 0, first_page - start);
+        memset(last_page, 0, end - last_page);
     } else {
-        _mmap_free(block_to_free);
+        memset(start, 0, end - start);
     }
+    _set_flags(block, HEADER(block) | ZEROED_BIT);
+    return released;
 }
 
-static void* _sbrk_realloc(head_metadata_t* block, size_t block_size)
+// Shrinks the free top block down to pad bytes and the break with it, returns true if it did
+static bool _trim_sbrk_top(arena_t* arena, size_t pad)
 {
-    void* program_break = _sbrk(0);
-    // Try to reuse the same block
-    if (block->size >= block_size) {
-        goto split_block_if_needed;
-    }
-    // Try to merge with lower address
-    block = _merge_sbrk_blocks(block, true, false, true);
-    if (block->size >= block_size) {
-        goto split_block_if_needed;
+    head_metadata_t* wilderness = _get_sbrk_wilderness(arena);
+    if (wilderness == nullptr) {
+        return false;
     }
-    // Is wilderness block
-    if ((void*)((uint8_t*)block + block->size) == program_break) {
-        allocated_bytes_num += block_size - block->size;
-        block = _wilderness_sbrk_block_increase(block, block_size);
-        return (void*)((uint8_t*)block + sizeof(head_metadata_t));
+    uintptr_t new_break = (uintptr_t)wilderness + MIN_BLOCK_SIZE + pad + BLOCK_OFFSET;
+    new_break = PAGE_ROUND_UP(new_break) - BLOCK_OFFSET;
+    if (new_break >= (uintptr_t)arena->heap_break) {
+        return false;
     }
-    // Try to merge with higher address
-    block = _merge_sbrk_blocks(block, false, true, false);
-    if (block->size >= block_size) {
-        goto split_block_if_needed;
+    size_t delta = (uintptr_t)arena->heap_break - new_break;
+    uint64_t zeroed = HEADER(wilderness) & ZEROED_BIT;
+    _remove_sbrk_free_block(arena, wilderness);
+    _resize_block(wilderness, new_break - (uintptr_t)wilderness);
+    _heap_sbrk(arena, -(intptr_t)delta);
+    _add_sbrk_free_block(arena, wilderness);
+    _set_flags(wilderness, HEADER(wilderness) | zeroed);
+    arena->free_bytes_num -= delta;
+    arena->allocated_bytes_num -= delta;
+    return true;
+}
+
+// When the free blocks it merges with are ZEROED the freed range is zeroed along with the footer and
+// header they leave inside of the merged block, so it stays ZEROED
+void _sbrk_free(arena_t* arena, head_metadata_t* block)
+{
+    void* from = block;
+    void* to = NEXT_BLOCK(block);
+    bool neighbors_zeroed = true;
+    if (IS_PREV_FREE(block)) {
+        neighbors_zeroed = IS_ZEROED((head_metadata_t*)((uint8_t*)block - FOOTER(block)));
     }
-    // Try to merge 3 block all toghether
-    block = _merge_sbrk_blocks(block, true, true, true);
-    if (block->size >= block_size) {
-        return (void*)((uint8_t*)block + sizeof(head_metadata_t));
+    if (to != arena->heap_break && _is_sbrk_free(arena, (head_metadata_t*)to)) {
+        neighbors_zeroed = neighbors_zeroed && IS_ZEROED((head_metadata_t*)to);
     }
-    // Is wilderness block
-    if ((void*)((uint8_t*)block + block->size) == program_break) {
-        allocated_bytes_num += block_size - block->size;
-        block = _wilderness_sbrk_block_increase(block, block_size);
-        return (void*)((uint8_t*)block + sizeof(head_metadata_t));
+    block = _merge_sbrk_blocks(arena, block);
+    arena->free_blocks_num++;
+    arena->free_bytes_num += BLOCK_SIZE(block) - _size_meta_data();
+    _add_sbrk_free_block(arena, block);
+    if (BLOCK_SIZE(block) >= TRIM_THRESHOLD && (void*)NEXT_BLOCK(block) == arena->heap_break) {
+        _trim_sbrk_top(arena, TRIM_PAD);
+    } else if (BLOCK_SIZE(block) >= RELEASE_THRESHOLD && neighbors_zeroed) {
+        _release_sbrk_free_block(block, (uint8_t*)from - sizeof(size_t), (uint8_t*)to + sizeof(head_metadata_t));
+    } else if (BLOCK_SIZE(block) >= RELEASE_THRESHOLD) {
+        _release_free_block(block, from, to);
     }
-    // If non of the options worked just allocate and copy to new block
-    return nullptr;
+}
 
-split_block_if_needed:
-    if (IS_REDUNDANT(block, block_size)) {
-        free_blocks_num++;
-        free_bytes_num += block->size - block_size - _size_meta_data();
-        allocated_blocks_num++;
-        allocated_bytes_num -= _size_meta_data();
-        size_t prev_size = block->size;
-        _init_sbrk_alloc_block(block, block_size, false);
-        _init_sbrk_free_block((head_metadata_t*)((uint8_t*)block + block_size), prev_size - block_size);
+static size_t _buddy_order(size_t block_size)
+{
+    if (block_size <= BUDDY_ORDER_SIZE(0)) {
+        return 0;
     }
-    return (void*)((uint8_t*)block + sizeof(head_metadata_t));
+    return 64 - __builtin_clzll(block_size - 1) - BUDDY_MIN_ORDER;
 }
 
-void* srealloc(void* oldp, size_t size)
+static void _buddy_flip_bit(arena_t* arena, head_metadata_t* block, size_t order)
 {
-    void* newp;
-    size = _8_bit_align(size);
-    if (oldp == nullptr) {
+    size_t bit = ((uint8_t*)block - arena->buddy_base) >> (BUDDY_MIN_ORDER + order);
+    arena->buddy_bitmaps[order][bit / 64] ^= (uint64_t)1 << (bit % 64);
+}
+
+static bool _is_buddy_free(arena_t* arena, head_metadata_t* block, size_t order)
+{
+    size_t bit = ((uint8_t*)block - arena->buddy_base) >> (BUDDY_MIN_ORDER + order);
+    return arena->buddy_bitmaps[order][bit / 64] & ((uint64_t)1 << (bit % 64));
+}
+
+static void _add_buddy_free_block(arena_t* arena, head_metadata_t* block, size_t order)
+{
+    _buddy_flip_bit(arena, block, order);
+    _set_flags(block, HEADER(block) | FREE_BIT);
+    block->prev = nullptr;
+    block->next = arena->buddy_free_lists[order];
+    if (block->next) {
+        block->next->prev = block;
+    }
+    arena->buddy_free_lists[order] = block;
+    arena->buddy_orders_mask |= 1 << order;
+    arena->free_blocks_num++;
+    arena->free_bytes_num += BLOCK_SIZE(block) - _size_meta_data();
+}
+
+static void _remove_buddy_free_block(arena_t* arena, head_metadata_t* block, size_t order)
+{
+    _buddy_flip_bit(arena, block, order);
+    _set_flags(block, HEADER(block) & ~FREE_BIT);
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        arena->buddy_free_lists[order] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    if (arena->buddy_free_lists[order] == nullptr) {
+        arena->buddy_orders_mask &= ~(1 << order);
+    }
+    block->next = nullptr;
+    block->prev = nullptr;
+    arena->free_blocks_num--;
+    arena->free_bytes_num -= BLOCK_SIZE(block) - _size_meta_data();
+}
+
+static head_metadata_t* _buddy_malloc(arena_t* arena, size_t block_size)
+{
+    size_t order = _buddy_order(block_size);
+    if (order >= BUDDY_ORDERS_NUM) {
+        return nullptr;
+    }
+    head_metadata_t* block;
+    size_t current;
+    uint32_t candidates = arena->buddy_orders_mask & (~(uint32_t)0 << order);
+    if (candidates) {
+        current = __builtin_ctz(candidates);
+        block = arena->buddy_free_lists[current];
+        _check_cookie(block);
+        _remove_buddy_free_block(arena, block, current);
+    } else {
+        uint8_t* top_end = arena->buddy_top + BUDDY_TOP_SIZE;
+        if (top_end > arena->buddy_base - BLOCK_OFFSET + BUDDY_REGION_SIZE) {
+            return nullptr;
+        }
+        if (top_end > arena->buddy_committed) {
+            uint8_t* committed = (uint8_t*)HEAP_COMMIT_ROUND_UP((uintptr_t)top_end);
+            if (mprotect(arena->buddy_committed, committed - arena->buddy_committed, PROT_READ | PROT_WRITE) != 0) {
+                return nullptr;
+            }
+            arena->buddy_committed = committed;
+        }
+        current = BUDDY_ORDERS_NUM - 1;
+        block = (head_metadata_t*)arena->buddy_top;
+        arena->buddy_top += BUDDY_TOP_SIZE;
+        _set_header(block, BUDDY_TOP_SIZE, arena->index, 0);
+        arena->allocated_blocks_num++;
+        arena->allocated_bytes_num += BUDDY_TOP_SIZE - _size_meta_data();
+    }
+    while (current > order) {
+        current--;
+        _resize_block(block, BUDDY_ORDER_SIZE(current));
+        head_metadata_t* buddy = NEXT_BLOCK(block);
+        _set_header(buddy, BUDDY_ORDER_SIZE(current), arena->index, 0);
+        arena->allocated_blocks_num++;
+        arena->allocated_bytes_num -= _size_meta_data();
+        _add_buddy_free_block(arena, buddy, current);
+    }
+    return block;
+}
+
+static void _buddy_free(arena_t* arena, head_metadata_t* block)
+{
+    void* from = block;
+    void* to = NEXT_BLOCK(block);
+    size_t order = _buddy_order(BLOCK_SIZE(block));
+    while (order < BUDDY_ORDERS_NUM - 1) {
+        size_t offset = (uint8_t*)block - arena->buddy_base;
+        head_metadata_t* buddy = (head_metadata_t*)(arena->buddy_base + (offset ^ BUDDY_ORDER_SIZE(order)));
+        if (!_is_buddy_free(arena, buddy, order)) {
+            break;
+        }
+        _check_cookie(buddy);
+        _remove_buddy_free_block(arena, buddy, order);
+        arena->allocated_blocks_num--;
+        arena->allocated_bytes_num += _size_meta_data();
+        if (buddy < block) {
+            block = buddy;
+        }
+        order++;
+        _resize_block(block, BUDDY_ORDER_SIZE(order));
+    }
+    _add_buddy_free_block(arena, block, order);
+    if (BLOCK_SIZE(block) >= RELEASE_THRESHOLD) {
+        _release_free_block(block, from, to);
+    }
+}
+
+// Buddy blocks are never known to be zero
+static head_metadata_t* _heap_malloc(arena_t* arena, size_t block_size, bool* zeroed = nullptr)
+{
+    if (heap_engine == BUDDY_ENGINE) {
+        if (zeroed) {
+            *zeroed = false;
+        }
+        return _buddy_malloc(arena, block_size);
+    }
+    return _sbrk_malloc(arena, block_size, zeroed);
+}
+
+// The n blocks are carved from one block of n * block_size found with a single search or wilderness
+// extension, the last one keeps what is left of it. Falls back to one block at a time if there is
+// no such block. Returns the number of blocks allocated
+static size_t _heap_malloc_batch(arena_t* arena, size_t block_size, size_t n, void** out)
+{
+    head_metadata_t* run = nullptr;
+    if (heap_engine == SBRK_ENGINE && n > 1 && n <= SIZE_MAX / block_size) {
+        run = _sbrk_malloc(arena, block_size * n);
+    }
+    if (run == nullptr) {
+        size_t count = 0;
+        for (head_metadata_t* block; count < n && (block = _heap_malloc(arena, block_size)); count++) {
+            out[count] = PAYLOAD_OF(block);
+        }
+        return count;
+    }
+    size_t run_size = BLOCK_SIZE(run);
+    uint64_t prev_free = HEADER(run) & PREV_FREE_BIT;
+    for (size_t i = 0; i < n; i++) {
+        head_metadata_t* block = (head_metadata_t*)((uint8_t*)run + i * block_size);
+        size_t size = (i == n - 1) ? run_size - (n - 1) * block_size : block_size;
+        _set_header(block, size, arena->index, (i == 0) ? prev_free : 0);
+        out[i] = PAYLOAD_OF(block);
+    }
+    arena->allocated_blocks_num += n - 1;
+    arena->allocated_bytes_num -= (n - 1) * _size_meta_data();
+    return n;
+}
+
+static void _heap_free(arena_t* arena, head_metadata_t* block)
+{
+    if (heap_engine == BUDDY_ENGINE) {
+        _buddy_free(arena, block);
+    } else {
+        _sbrk_free(arena, block);
+    }
+}
+
+static slab_t* _new_slab(arena_t* arena, size_t slot_size)
+{
+    slab_t* slab = arena->empty_slabs;
+    if (slab) {
+        arena->empty_slabs = slab->next;
+    } else {
+        size_t offset = __atomic_fetch_add(&slab_region_used, SLAB_SIZE, __ATOMIC_RELAXED);
+        if (slab_region == nullptr || offset >= SLAB_REGION_SIZE) {
+            return nullptr;
+        }
+        slab = (slab_t*)(slab_region + offset);
+        slab->arena = arena->index;
+        arena->slabs_num++;
+    }
+    slab->slot_size = slot_size;
+    slab->slots_num = (SLAB_SIZE - SLAB_HEADER_SIZE) / slot_size;
+    slab->used_num = 0;
+    memset(slab->free_bitmap, 0, sizeof(slab->free_bitmap));
+    for (size_t i = 0; i < slab->slots_num; i++) {
+        slab->free_bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+    slab->prev = nullptr;
+    slab->next = arena->partial_slabs[slot_size / 8 - 1];
+    if (slab->next) {
+        slab->next->prev = slab;
+    }
+    arena->partial_slabs[slot_size / 8 - 1] = slab;
+    return slab;
+}
+
+static void _unlink_partial_slab(arena_t* arena, slab_t* slab)
+{
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        arena->partial_slabs[slab->slot_size / 8 - 1] = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+static void* _slab_malloc(arena_t* arena, size_t size)
+{
+    slab_t* slab = arena->partial_slabs[size / 8 - 1];
+    if (slab == nullptr) {
+        slab = _new_slab(arena, size);
+        if (slab == nullptr) {
+            return nullptr;
+        }
+    }
+    size_t word = 0;
+    while (slab->free_bitmap[word] == 0) {
+        word++;
+    }
+    size_t slot = word * 64 + __builtin_ctzll(slab->free_bitmap[word]);
+    slab->free_bitmap[word] &= ~((uint64_t)1 << (slot % 64));
+    if (++slab->used_num == slab->slots_num) {
+        _unlink_partial_slab(arena, slab);
+    }
+    arena->slab_slots_num++;
+    arena->allocated_blocks_num++;
+    arena->allocated_bytes_num += size;
+    return SLAB_SLOTS(slab) + slot * slab->slot_size;
+}
+
+static void _slab_free(arena_t* arena, void* p)
+{
+    slab_t* slab = SLAB_OF(p);
+    size_t slot = ((uint8_t*)p - SLAB_SLOTS(slab)) / slab->slot_size;
+    uint64_t bit = (uint64_t)1 << (slot % 64);
+    // A slot that is freed twice without being checked was cached twice and handed out twice
+    if (slab->free_bitmap[slot / 64] & bit) {
+#if MALLOC4_CHECK_LEVEL >= CHECK_FULL
+        exit(0xdeadbeef);
+#endif
+        return;
+    }
+    slab->free_bitmap[slot / 64] |= bit;
+    arena->slab_slots_num--;
+    arena->allocated_blocks_num--;
+    arena->allocated_bytes_num -= slab->slot_size;
+    if (slab->used_num-- == slab->slots_num) {
+        slab->prev = nullptr;
+        slab->next = arena->partial_slabs[slab->slot_size / 8 - 1];
+        if (slab->next) {
+            slab->next->prev = slab;
+        }
+        arena->partial_slabs[slab->slot_size / 8 - 1] = slab;
+    }
+    if (slab->used_num == 0) {
+        _unlink_partial_slab(arena, slab);
+        slab->next = arena->empty_slabs;
+        arena->empty_slabs = slab;
+    }
+}
+
+static arena_t* _owner_arena(void* p)
+{
+    return (IS_SLAB_PTR(p)) ? &arenas[SLAB_OF(p)->arena] : BLOCK_ARENA(BLOCK_OF(p));
+}
+
+// Has to be called with the arena lock held
+static void _arena_free(arena_t* arena, void* p)
+{
+    if (IS_SLAB_PTR(p)) {
+        _slab_free(arena, p);
+    } else {
+        _heap_free(arena, BLOCK_OF(p));
+    }
+}
+
+// Lock free push of a pointer owned by another arena, a single CAS on the owner remote stack
+static void _remote_free(arena_t* arena, void* p)
+{
+    BLOCK_OF(p)->prev = CACHED_MARK;
+    void* head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+    do {
+        NEXT_FREE(p) = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, p, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Has to be called with the arena lock held
+static void _drain_remote_frees(arena_t* arena)
+{
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == nullptr) {
+        return;
+    }
+    void* p = __atomic_exchange_n(&arena->remote_frees, nullptr, __ATOMIC_ACQUIRE);
+    while (p) {
+        void* next = NEXT_FREE(p);
+        _arena_free(arena, p);
+        p = next;
+    }
+}
+
+// Frees up to count pointers of a cache bin, pointers of other arenas are handed to their owners
+static void _tcache_release(arena_t* own, tcache_bin_t* bin, size_t count)
+{
+    bool locked = false;
+    for (size_t i = 0; i < count && bin->head; i++) {
+        void* p = bin->head;
+        arena_t* arena = _owner_arena(p);
+        bin->head = NEXT_FREE(p);
+        bin->count--;
+        if (arena != own) {
+            _remote_free(arena, p);
+            continue;
+        }
+        if (!locked) {
+            pthread_mutex_lock(&own->lock);
+            locked = true;
+        }
+        _arena_free(own, p);
+    }
+    if (locked) {
+        pthread_mutex_unlock(&own->lock);
+    }
+}
+
+// Thread exit destructor, gives all the cached blocks back to their arenas
+static void _release_thread(void* arena)
+{
+    for (size_t i = 0; i < TCACHE_BINS_NUM; i++) {
+        _tcache_release((arena_t*)arena, &tcache[i], tcache[i].count);
+    }
+    __atomic_fetch_sub(&((arena_t*)arena)->threads_num, 1, __ATOMIC_RELAXED);
+}
+
+// Every arena gets a slice of one PROT_NONE reservation. The per order bitmaps cover all of it and
+// live in a mapping of their own whose pages are only touched for the part of the region in use
+static void _init_buddy_regions()
+{
+    size_t bitmap_words = 0;
+    for (size_t order = 0; order < BUDDY_ORDERS_NUM; order++) {
+        bitmap_words += (BUDDY_REGION_SIZE / BUDDY_ORDER_SIZE(order) + 63) / 64;
+    }
+    void* region = _thp_mmap(arenas_num * BUDDY_REGION_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS);
+    if (region == (void*)(-1)) {
+        heap_engine = SBRK_ENGINE;
+        return;
+    }
+    void* bitmaps = mmap(nullptr, arenas_num * bitmap_words * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (bitmaps == (void*)(-1)) {
+        munmap(region, arenas_num * BUDDY_REGION_SIZE);
+        heap_engine = SBRK_ENGINE;
+        return;
+    }
+    buddy_region = (uint8_t*)region;
+    for (size_t i = 0; i < arenas_num; i++) {
+        arena_t* arena = &arenas[i];
+        arena->buddy_base = buddy_region + i * BUDDY_REGION_SIZE + BLOCK_OFFSET;
+        arena->buddy_top = arena->buddy_base;
+        arena->buddy_committed = buddy_region + i * BUDDY_REGION_SIZE;
+        uint64_t* bitmap = (uint64_t*)bitmaps + i * bitmap_words;
+        for (size_t order = 0; order < BUDDY_ORDERS_NUM; order++) {
+            arena->buddy_bitmaps[order] = bitmap;
+            bitmap += (BUDDY_REGION_SIZE / BUDDY_ORDER_SIZE(order) + 63) / 64;
+        }
+    }
+}
+
+// SAMPLED shares the header with PREV_FREE, which the arena sets under its lock
+static void _set_sampled(head_metadata_t* block, bool sampled)
+{
+    arena_t* arena = BLOCK_ARENA(block);
+    pthread_mutex_lock(&arena->lock);
+    _set_flags(block, (sampled) ? HEADER(block) | SAMPLED_BIT : HEADER(block) & ~SAMPLED_BIT);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+// Finds the bucket of a backtrace or adds it, returns PROFILE_BUCKETS_NUM if the table is full
+static uint32_t _profile_bucket(void* const* stack, uint32_t depth)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (uint32_t i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)stack[i]) * 0x100000001b3;
+    }
+    for (uint32_t i = 0; i < PROFILE_BUCKETS_NUM; i++) {
+        uint32_t index = (hash + i) % PROFILE_BUCKETS_NUM;
+        profile_bucket_t* bucket = &profile.buckets[index];
+        if (bucket->depth == 0) {
+            bucket->hash = hash;
+            bucket->depth = depth;
+            memcpy(bucket->stack, stack, depth * sizeof(void*));
+            return index;
+        }
+        if (bucket->hash == hash && bucket->depth == depth && memcmp(bucket->stack, stack, depth * sizeof(void*)) == 0) {
+            return index;
+        }
+    }
+    return PROFILE_BUCKETS_NUM;
+}
+
+// The live samples are an open addressing table by block address
+static size_t _profile_slot(head_metadata_t* block)
+{
+    return (size_t)((((uintptr_t)block >> 4) * 0x9e3779b97f4a7c15) >> 32) % PROFILE_SAMPLES_NUM;
+}
+
+// Returns the slot of block or the unused slot it would take
+static profile_sample_t* _profile_find(head_metadata_t* block)
+{
+    for (size_t i = _profile_slot(block);; i = (i + 1) % PROFILE_SAMPLES_NUM) {
+        if (profile.samples[i].block == block || profile.samples[i].block == nullptr) {
+            return &profile.samples[i];
+        }
+    }
+}
+
+// The samples after the removed one are shifted back into the hole unless that would put them
+// before their own slot
+static void _profile_remove(profile_sample_t* sample)
+{
+    size_t hole = sample - profile.samples;
+    for (size_t i = (hole + 1) % PROFILE_SAMPLES_NUM; profile.samples[i].block; i = (i + 1) % PROFILE_SAMPLES_NUM) {
+        size_t home = _profile_slot(profile.samples[i].block);
+        if ((i > hole) ? (home <= hole || home > i) : (home <= hole && home > i)) {
+            profile.samples[hole] = profile.samples[i];
+            hole = i;
+        }
+    }
+    profile.samples[hole].block = nullptr;
+    profile.samples_num--;
+}
+
+// Formats into a stack buffer and writes it out, nothing is allocated so it is fine in a signal handler
+static void _profile_write(int fd, const char* format, ...)
+{
+    char line[PROFILE_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length > 0 && write(fd, line, ((size_t)length < sizeof(line)) ? length : sizeof(line) - 1) < 0) {
+        return;
+    }
+}
+
+// Has to be called with the profile lock held. pprof scales the samples back up by the period that
+// follows heap_v2, the mappings let it symbolize the addresses
+static void _profile_dump()
+{
+    char path[sizeof(profile.prefix) + 64];
+    snprintf(path, sizeof(path), "%s.%d.%zu.heap", profile.prefix, (int)getpid(), profile.dumps_num++);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    size_t inuse_objects = 0, inuse_bytes = 0, alloc_objects = 0, alloc_bytes = 0;
+    for (size_t i = 0; i < PROFILE_BUCKETS_NUM; i++) {
+        inuse_objects += profile.buckets[i].inuse_objects;
+        inuse_bytes += profile.buckets[i].inuse_bytes;
+        alloc_objects += profile.buckets[i].alloc_objects;
+        alloc_bytes += profile.buckets[i].alloc_bytes;
+    }
+    _profile_write(fd, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", inuse_objects, inuse_bytes, alloc_objects, alloc_bytes, profile_period);
+    for (size_t i = 0; i < PROFILE_BUCKETS_NUM; i++) {
+        profile_bucket_t* bucket = &profile.buckets[i];
+        if (bucket->depth == 0) {
+            continue;
+        }
+        char line[PROFILE_LINE_SIZE];
+        int length = snprintf(line, sizeof(line), "%zu: %zu [%zu: %zu] @", bucket->inuse_objects, bucket->inuse_bytes, bucket->alloc_objects, bucket->alloc_bytes);
+        for (uint32_t frame = 0; frame < bucket->depth && length < PROFILE_LINE_SIZE - 24; frame++) {
+            length += snprintf(line + length, sizeof(line) - length, " %p", bucket->stack[frame]);
+        }
+        _profile_write(fd, "%s\n", line);
+        if (bucket->freed_objects) {
+            _profile_write(fd, "# lifetime: %zu freed, %llu us on average\n", bucket->freed_objects, (unsigned long long)(bucket->lifetime_ns / bucket->freed_objects / 1000));
+        }
+    }
+    _profile_write(fd, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+        char buffer[4096];
+        ssize_t length;
+        while ((length = read(maps, buffer, sizeof(buffer))) > 0 && write(fd, buffer, length) == length) {
+        }
+        close(maps);
+    }
+    close(fd);
+}
+
+// A signal that comes in after the last check and finds the lock still held is picked up again
+static void _profile_unlock()
+{
+    do {
+        while (__atomic_exchange_n(&profile.dump_pending, 0, __ATOMIC_ACQUIRE)) {
+            _profile_dump();
+        }
+        pthread_mutex_unlock(&profile.lock);
+    } while (__atomic_load_n(&profile.dump_pending, __ATOMIC_ACQUIRE) && pthread_mutex_trylock(&profile.lock) == 0);
+}
+
+// The thread it interrupts may hold the lock, then the dump is left to it
+static void _profile_signal(int)
+{
+    if (pthread_mutex_trylock(&profile.lock) != 0) {
+        __atomic_store_n(&profile.dump_pending, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    _profile_dump();
+    _profile_unlock();
+}
+
+__attribute__((destructor)) static void _profile_dump_at_exit()
+{
+    if (profile_period == 0) {
+        return;
+    }
+    pthread_mutex_lock(&profile.lock);
+    _profile_dump();
+    _profile_unlock();
+}
+
+// Records an allocation of size bytes at p. Slab slots have no header to mark, they are never sampled
+__attribute__((noinline)) static void _profile_record(void* p, size_t size)
+{
+    if (IS_SLAB_PTR(p) || IS_ALIGNED_TAG(BLOCK_OF(p))) {
+        return;
+    }
+    head_metadata_t* block = BLOCK_OF(p);
+    void* stack[PROFILE_MAX_DEPTH + 1];
+    int depth = backtrace(stack, PROFILE_MAX_DEPTH + 1);
+    // The first frame is this function
+    if (depth <= 1) {
+        return;
+    }
+    uint64_t now = _now_ns();
+    pthread_mutex_lock(&profile.lock);
+    uint32_t index = _profile_bucket(stack + 1, depth - 1);
+    profile_sample_t* sample = _profile_find(block);
+    if (index < PROFILE_BUCKETS_NUM && sample->block == nullptr && profile.samples_num < PROFILE_SAMPLES_NUM / 4 * 3) {
+        profile_bucket_t* bucket = &profile.buckets[index];
+        bucket->alloc_objects++;
+        bucket->alloc_bytes += size;
+        bucket->inuse_objects++;
+        bucket->inuse_bytes += size;
+        sample->block = block;
+        sample->bucket = index;
+        sample->size = size;
+        sample->allocated_at = now;
+        profile.samples_num++;
+        _set_sampled(block, true);
+    }
+    _profile_unlock();
+}
+
+// Takes the sample of a block out of the table while srealloc may move it, it still counts as in use
+// until _profile_settle. Returns false if the block had none
+static bool _profile_detach(head_metadata_t* block, profile_sample_t* detached)
+{
+    pthread_mutex_lock(&profile.lock);
+    profile_sample_t* sample = _profile_find(block);
+    bool found = sample->block != nullptr;
+    if (found) {
+        *detached = *sample;
+        _profile_remove(sample);
+    }
+    _set_sampled(block, false);
+    _profile_unlock();
+    return found;
+}
+
+// Puts a detached sample back on block, or counts it as freed when block is nullptr (or the table
+// filled up in the meantime)
+static void _profile_settle(const profile_sample_t* detached, head_metadata_t* block)
+{
+    uint64_t now = _now_ns();
+    pthread_mutex_lock(&profile.lock);
+    profile_sample_t* sample = (block) ? _profile_find(block) : nullptr;
+    if (sample && sample->block == nullptr && profile.samples_num < PROFILE_SAMPLES_NUM / 4 * 3) {
+        *sample = *detached;
+        sample->block = block;
+        profile.samples_num++;
+        _set_sampled(block, true);
+    } else {
+        profile_bucket_t* bucket = &profile.buckets[detached->bucket];
+        bucket->inuse_objects--;
+        bucket->inuse_bytes -= detached->size;
+        bucket->freed_objects++;
+        bucket->lifetime_ns += now - detached->allocated_at;
+    }
+    _profile_unlock();
+}
+
+// Called before a sampled block is freed
+static void _profile_free(head_metadata_t* block)
+{
+    profile_sample_t detached;
+    if (_profile_detach(block, &detached)) {
+        _profile_settle(&detached, nullptr);
+    }
+}
+
+static void _init_profile()
+{
+    const char* env = getenv(PROFILE_ENV);
+    long period = (env) ? atol(env) : 0;
+    if (period <= 0) {
+        return;
+    }
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    void* buckets = mmap(nullptr, PROFILE_BUCKETS_NUM * sizeof(profile_bucket_t), PROT_READ | PROT_WRITE, flags, -1, 0);
+    void* samples = mmap(nullptr, PROFILE_SAMPLES_NUM * sizeof(profile_sample_t), PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (buckets == (void*)(-1) || samples == (void*)(-1)) {
+        return;
+    }
+    profile.buckets = (profile_bucket_t*)buckets;
+    profile.samples = (profile_sample_t*)samples;
+    env = getenv(PROFILE_PREFIX_ENV);
+    snprintf(profile.prefix, sizeof(profile.prefix), "%s", (env) ? env : PROFILE_DEFAULT_PREFIX);
+    // backtrace loads what it needs the first time it is called, and that may allocate
+    void* frame;
+    backtrace(&frame, 1);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = _profile_signal;
+    action.sa_flags = SA_RESTART;
+    sigaction(PROFILE_SIGNAL, &action, nullptr);
+    profile_period = period;
+}
+
+// The locks are held across fork so the child never inherits a heap in the middle of an update
+static void _fork_prepare()
+{
+    pthread_mutex_lock(&profile.lock);
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+    pthread_mutex_lock(&mmap_cache.lock);
+    pthread_mutex_lock(&region_pool.lock);
+}
+
+static void _fork_parent()
+{
+    pthread_mutex_unlock(&region_pool.lock);
+    pthread_mutex_unlock(&mmap_cache.lock);
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    pthread_mutex_unlock(&profile.lock);
+}
+
+// Only the forking thread exists in the child, the locks it holds are reset
+static void _fork_child()
+{
+    pthread_mutex_init(&mmap_cache.lock, nullptr);
+    pthread_mutex_init(&region_pool.lock, nullptr);
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_init(&arenas[i].lock, nullptr);
+    }
+    pthread_mutex_init(&profile.lock, nullptr);
+}
+
+static void _init_arenas()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpus_num = (cpus > 0) ? cpus : 1;
+    const char* env = getenv(ARENAS_ENV);
+    long num = (env) ? atol(env) : cpus_num;
+    arenas_num = (num < 1) ? 1 : (num > MAX_ARENAS) ? MAX_ARENAS : num;
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_init(&arenas[i].lock, nullptr);
+        arenas[i].index = i;
+    }
+#if MALLOC4_CHECK_LEVEL > CHECK_NONE
+    _init_cookie();
+#endif
+    pthread_key_create(&thread_key, _release_thread);
+    pthread_atfork(_fork_prepare, _fork_parent, _fork_child);
+    _init_profile();
+    env = getenv(ENGINE_ENV);
+    if (env) {
+        heap_engine = (strcmp(env, "buddy") == 0) ? BUDDY_ENGINE : SBRK_ENGINE;
+    }
+    env = getenv(THP_ENV);
+    if (env) {
+        thp_enabled = strcmp(env, "0") != 0;
+    }
+    if (heap_engine == BUDDY_ENGINE) {
+        _init_buddy_regions();
+    }
+    // Reserved before the first allocation so IS_SLAB_PTR never sees it change
+    void* region = _thp_mmap(SLAB_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+    if (region != (void*)(-1)) {
+        slab_region = (uint8_t*)region;
+    }
+}
+
+// A thread is bound on first use to the arena of the cpu it runs on, or round robin when there
+// are more arenas than cpus
+static arena_t* _thread_arena()
+{
+    if (thread_arena) {
+        return thread_arena;
+    }
+    pthread_once(&arenas_once, _init_arenas);
+    int cpu = sched_getcpu();
+    size_t index;
+    if (cpu < 0 || arenas_num > cpus_num) {
+        index = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+    } else {
+        index = cpu;
+    }
+    thread_arena = &arenas[index % arenas_num];
+    __atomic_fetch_add(&thread_arena->threads_num, 1, __ATOMIC_RELAXED);
+    pthread_setspecific(thread_key, thread_arena);
+    return thread_arena;
+}
+
+// Called once the countdown of the thread ran out, draws the next distance from an exponential
+// distribution so allocation patterns that repeat every period bytes are still sampled fairly.
+// Returns true if the allocation that ran it out is sampled, the first one of a thread is not
+static bool _profile_next_sample()
+{
+    _thread_arena();
+    if (profile_period == 0) {
+        profile_countdown = INTPTR_MAX;
+        return false;
+    }
+    bool sampled = profile_seed != 0;
+    if (!sampled) {
+        profile_seed = (unsigned int)(_now_ns() ^ (uintptr_t)&profile_seed) | 1;
+    }
+    double u = (rand_r(&profile_seed) + 1.0) / ((double)RAND_MAX + 2.0);
+    profile_countdown = (intptr_t)(-log(u) * profile_period) + 1;
+    return sampled;
+}
+
+// Small sizes come from slabs and fall back to the heap if the slab region is exhausted
+static void _tcache_refill(tcache_bin_t* bin, size_t size)
+{
+    arena_t* arena = _thread_arena();
+    pthread_mutex_lock(&arena->lock);
+    _drain_remote_frees(arena);
+    for (size_t i = 0; i < TCACHE_BATCH; i++) {
+        void* p = (IS_SLAB_SIZE(size)) ? _slab_malloc(arena, size) : nullptr;
+        if (p == nullptr) {
+            head_metadata_t* block = _heap_malloc(arena, _block_size_of(size));
+            if (block == nullptr) {
+                break;
+            }
+            block->prev = CACHED_MARK;
+            p = PAYLOAD_OF(block);
+        }
+        NEXT_FREE(p) = bin->head;
+        bin->head = p;
+        bin->count++;
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+static void* _tcache_malloc(size_t size)
+{
+    tcache_bin_t* bin = TCACHE_BIN(size);
+    if (bin->head == nullptr) {
+        _tcache_refill(bin, size);
+        if (bin->head == nullptr) {
+            return nullptr;
+        }
+    }
+    void* p = bin->head;
+    bin->head = NEXT_FREE(p);
+    bin->count--;
+    if (!IS_SLAB_PTR(p)) {
+        _check_cookie(BLOCK_OF(p));
+    }
+    // Slots are headerless but the mark is in their second word just the same
+    BLOCK_OF(p)->prev = nullptr;
+    return p;
+}
+
+// Blocks are cached by their real size which can be bigger than the size they were requested for
+static void _tcache_free(void* p, size_t size)
+{
+    // Binds a thread that only frees as well so its cache is released on exit
+    arena_t* own = _thread_arena();
+    tcache_bin_t* bin = TCACHE_BIN(size);
+    if (bin->count == TCACHE_BIN_CAPACITY) {
+        _tcache_release(own, bin, TCACHE_BATCH);
+    }
+    BLOCK_OF(p)->prev = CACHED_MARK;
+    NEXT_FREE(p) = bin->head;
+    bin->head = p;
+    bin->count++;
+}
+
+#ifndef MALLOC4_SIDE_TABLE
+// Releases the pages of every free block of a log bin tree
+static bool _release_free_tree(head_metadata_t* root)
+{
+    if (root == nullptr) {
+        return false;
+    }
+    _check_cookie(root);
+    bool released = _release_sbrk_free_block(root, root, NEXT_BLOCK(root));
+    released |= _release_free_tree(root->prev);
+    released |= _release_free_tree(root->next);
+    return released;
+}
+#endif
+
+#ifdef MALLOC4_SIDE_TABLE
+// Releases the pages of every free block of the heap, found by scanning the side table
+static bool _release_side_table(arena_t* arena)
+{
+    if (arena->side_table == nullptr) {
+        return false;
+    }
+    bool released = false;
+    size_t chunks_num = ((uint8_t*)arena->heap_break - HEAP_START(arena) + SIDE_CHUNK_SIZE - 1) / SIDE_CHUNK_SIZE;
+    for (size_t i = 0; i < chunks_num; i++) {
+        side_chunk_t* chunk = &arena->side_table[i];
+        for (size_t mask = 0; mask < SIDE_CHUNK_WORDS / 64; mask++) {
+            for (uint64_t words = chunk->words_mask[mask]; words; words &= words - 1) {
+                size_t word = mask * 64 + __builtin_ctzll(words);
+                for (uint64_t bits = chunk->free_bitmap[word]; bits; bits &= bits - 1) {
+                    size_t granule = i * SIDE_CHUNK_GRANULES + word * 64 + __builtin_ctzll(bits);
+                    head_metadata_t* block = (head_metadata_t*)(HEAP_START(arena) + granule * 8);
+                    _check_cookie(block);
+                    released |= _release_sbrk_free_block(block, block, NEXT_BLOCK(block));
+                }
+            }
+        }
+    }
+    return released;
+}
+#endif
+
+// Has to be called with the arena lock held
+static bool _trim_arena(arena_t* arena, size_t pad)
+{
+    bool released = false;
+    if (heap_engine == BUDDY_ENGINE) {
+        for (size_t order = 0; order < BUDDY_ORDERS_NUM; order++) {
+            for (head_metadata_t* block = arena->buddy_free_lists[order]; block; block = block->next) {
+                released |= _release_free_block(block, block, NEXT_BLOCK(block));
+            }
+        }
+        return released;
+    }
+    released = _trim_sbrk_top(arena, pad);
+#ifdef MALLOC4_SIDE_TABLE
+    released |= _release_side_table(arena);
+#else
+    // Exact bin blocks are smaller than a page and can't have one inside of them
+    for (size_t index = EXACT_BINS_NUM; index < BINS_NUM; index++) {
+        released |= _release_free_tree(arena->free_bins[index]);
+    }
+#endif
+    return released;
+}
+
+static bool _flush_region_pool();
+
+// Gives free memory back to the OS like malloc_trim. The calling thread's cache is released, the top
+// of every heap is trimmed down to pad bytes, the pages inside of free blocks are released and the
+// cached mmap chunks and pooled region chunks are freed.
+// Returns 1 if any memory was given back and 0 otherwise
+int smalloc_trim(size_t pad)
+{
+    arena_t* own = _thread_arena();
+    bool released = _flush_region_pool();
+    for (size_t i = 0; i < TCACHE_BINS_NUM; i++) {
+        _tcache_release(own, &tcache[i], tcache[i].count);
+    }
+    released |= _flush_mmap_cache();
+    for (size_t i = 0; i < arenas_num; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+        _drain_remote_frees(&arenas[i]);
+        released |= _trim_arena(&arenas[i], pad);
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    return released;
+}
+
+// Allocates a block that is too big for the thread cache from the heap or with mmap
+static head_metadata_t* _block_malloc(size_t block_size, bool* zeroed = nullptr)
+{
+    if (!ALLOC_SBRK(block_size)) {
+        return _mmap_malloc(_thread_arena(), block_size, false, zeroed);
+    }
+    arena_t* arena = _thread_arena();
+    pthread_mutex_lock(&arena->lock);
+    _drain_remote_frees(arena);
+    head_metadata_t* block = _heap_malloc(arena, block_size, zeroed);
+    pthread_mutex_unlock(&arena->lock);
+    return block;
+}
+
+// Sampled allocations get a heap block even if they are small so the header can mark them
+static void* _profile_malloc(size_t size)
+{
+    head_metadata_t* block = _block_malloc(_block_size_of(size));
+    if (block == nullptr) {
+        return nullptr;
+    }
+    _profile_record(PAYLOAD_OF(block), size);
+    return PAYLOAD_OF(block);
+}
+
+// smalloc of an aligned size within the limit that the caller already charged the profiler for
+static void* _smalloc_uncharged(size_t size)
+{
+    if (IS_TCACHE_SIZE(size)) {
+        return _tcache_malloc(size);
+    }
+    head_metadata_t* block = _block_malloc(_block_size_of(size));
+    return (block) ? PAYLOAD_OF(block) : nullptr;
+}
+
+void* smalloc(size_t size)
+{
+    size = _align_size(size);
+    if (size == 0 || size > SIZE_LIMIT) {
+        return nullptr;
+    }
+    // The only cost of the profiler on an allocation that is not sampled
+    if (__builtin_expect(PROFILE_CHARGE(size), 0) && _profile_next_sample()) {
+        return _profile_malloc(size);
+    }
+    return _smalloc_uncharged(size);
+}
+
+// Allocates n blocks of size bytes into out under one lock, heap blocks are carved next to each other
+// from a single free block. Returns the number of blocks allocated, the rest of out is left as is
+size_t smalloc_batch(size_t size, size_t n, void** out)
+{
+    size = _align_size(size);
+    if (size == 0 || size > SIZE_LIMIT) {
+        return 0;
+    }
+    size_t block_size = _block_size_of(size);
+    if (IS_TCACHE_SIZE(size) || !ALLOC_SBRK(block_size)) {
+        size_t count = 0;
+        for (void* p; count < n && (p = smalloc(size)); count++) {
+            out[count] = p;
+        }
+        return count;
+    }
+    arena_t* arena = _thread_arena();
+    pthread_mutex_lock(&arena->lock);
+    _drain_remote_frees(arena);
+    size_t count = _heap_malloc_batch(arena, block_size, n, out);
+    pthread_mutex_unlock(&arena->lock);
+    return count;
+}
+
+// A block that is known to be zero is only cleared where it may still hold the footer it had while
+// it was free, a fresh block never gets its pages touched
+void* scalloc(size_t num, size_t size)
+{
+    size = _align_size(num * size);
+    if (size == 0 || size > SIZE_LIMIT) {
+        return nullptr;
+    }
+    if (IS_TCACHE_SIZE(size)) {
+        void* alloc = smalloc(size);
+        if (alloc) {
+            memset(alloc, 0, size);
+        }
+        return alloc;
+    }
+    bool sampled = __builtin_expect(PROFILE_CHARGE(size), 0) && _profile_next_sample();
+    head_metadata_t* block;
+    bool zeroed = false;
+    size_t block_size = _block_size_of(size);
+    if (block_size > SCALLOC_HUGE_PAGE_LIMIT + _size_meta_data()) {
+        block = _mmap_malloc(_thread_arena(), block_size, true, &zeroed);
+    } else {
+        block = _block_malloc(block_size, &zeroed);
+    }
+    if (block == nullptr) {
+        return nullptr;
+    }
+    void* alloc = PAYLOAD_OF(block);
+    size_t footer = BLOCK_SIZE(block) - _size_meta_data() - sizeof(size_t);
+    if (!zeroed) {
+        memset(alloc, 0, size);
+    } else if (footer < size) {
+        memset((uint8_t*)alloc + footer, 0, sizeof(size_t));
+    }
+    if (sampled) {
+        _profile_record(alloc, size);
+    }
+    return alloc;
+}
+
+// Buddy blocks can't be cut, so the block is padded by alignment bytes and the aligned pointer is
+// tagged with its offset into the payload so sfree finds the block
+static void* _tagged_aligned_alloc(size_t alignment, size_t size)
+{
+    // Slab slots have no header before them to hold the tag
+    size_t padded_size = size + alignment - PAYLOAD_ALIGNMENT;
+    padded_size = (padded_size > SLAB_SIZE_LIMIT) ? padded_size : SLAB_SIZE_LIMIT + 8;
+    uint8_t* p = (uint8_t*)smalloc(padded_size);
+    if (p == nullptr || (uintptr_t)p % alignment == 0) {
+        return p;
+    }
+    uint8_t* aligned = (uint8_t*)(((uintptr_t)p + alignment - 1) & ~((uintptr_t)alignment - 1));
+    BLOCK_OF(aligned)->header = ((uint64_t)(aligned - p) << 3) | ALIGNED_TAG;
+    return aligned;
+}
+
+// The leading padding up to the aligned block and the slack after it are freed back into the heap
+static head_metadata_t* _sbrk_aligned_malloc(arena_t* arena, size_t block_size, size_t alignment)
+{
+    head_metadata_t* block = _sbrk_malloc(arena, block_size + alignment + MIN_BLOCK_SIZE);
+    if (block == nullptr) {
+        return nullptr;
+    }
+    uintptr_t start = (uintptr_t)block;
+    uintptr_t aligned = ((start + HEADER_SIZE + alignment - 1) & ~((uintptr_t)alignment - 1)) - HEADER_SIZE;
+    // The padding has to fit a free block of its own
+    while (aligned != start && aligned - start < MIN_BLOCK_SIZE) {
+        aligned += alignment;
+    }
+    if (aligned != start) {
+        head_metadata_t* padding = block;
+        block = (head_metadata_t*)aligned;
+        _set_header(block, BLOCK_SIZE(padding) - (aligned - start), arena->index, 0);
+        _resize_block(padding, aligned - start);
+        arena->allocated_blocks_num++;
+        arena->allocated_bytes_num -= _size_meta_data();
+        _sbrk_free(arena, padding);
+    }
+    if (IS_REDUNDANT(block, block_size)) {
+        head_metadata_t* slack = (head_metadata_t*)((uint8_t*)block + block_size);
+        _set_header(slack, BLOCK_SIZE(block) - block_size, arena->index, 0);
+        _resize_block(block, block_size);
+        arena->allocated_blocks_num++;
+        arena->allocated_bytes_num -= _size_meta_data();
+        _sbrk_free(arena, slack);
+    }
+    return block;
+}
+
+// The mapping is padded by alignment bytes and the whole pages before and after the aligned block
+// are unmapped, its header ends up inside of the first page that is left
+static head_metadata_t* _mmap_aligned_malloc(arena_t* arena, size_t block_size, size_t alignment)
+{
+    size_t length = PAGE_ROUND_UP(block_size + alignment);
+    uint8_t* mmap_addr = (uint8_t*)mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mmap_addr == (void*)(-1)) {
+        return nullptr;
+    }
+    uintptr_t aligned = ((uintptr_t)mmap_addr + HEADER_SIZE + alignment - 1) & ~((uintptr_t)alignment - 1);
+    head_metadata_t* block = BLOCK_OF(aligned);
+    _set_header(block, block_size, arena->index, MMAPPED_BIT);
+    if (MMAP_START(block) != mmap_addr) {
+        munmap(mmap_addr, MMAP_START(block) - mmap_addr);
+    }
+    if (MMAP_END(block) != mmap_addr + length) {
+        munmap(MMAP_END(block), mmap_addr + length - MMAP_END(block));
+    }
+    pthread_mutex_lock(&arena->lock);
+    arena->allocated_blocks_num++;
+    arena->allocated_bytes_num += block_size - _size_meta_data();
+    pthread_mutex_unlock(&arena->lock);
+    return block;
+}
+
+// Returns size bytes aligned to alignment, a power of two. The aligned block is cut from a bigger
+// heap block or mapping and is a regular block for sfree and srealloc
+void* saligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return nullptr;
+    }
+    if (alignment <= PAYLOAD_ALIGNMENT) {
         return smalloc(size);
     }
-    head_metadata_t* old_block = (head_metadata_t*)((uint8_t*)oldp - sizeof(head_metadata_t));
+    size = _align_size(size);
+    if (size == 0 || size > SIZE_LIMIT || alignment > SIZE_LIMIT) {
+        return nullptr;
+    }
+    size_t block_size = _block_size_of(size);
+    head_metadata_t* block = nullptr;
+    // The engine is only known once the arenas are initialized
+    arena_t* arena = _thread_arena();
+    bool fits_heap = ALLOC_SBRK(block_size + alignment + MIN_BLOCK_SIZE);
+    // The padded block of a tagged allocation is charged and sampled by smalloc
+    if (fits_heap && heap_engine == BUDDY_ENGINE) {
+        return _tagged_aligned_alloc(alignment, size);
+    }
+    bool sampled = __builtin_expect(PROFILE_CHARGE(size), 0) && _profile_next_sample();
+    if (fits_heap) {
+        pthread_mutex_lock(&arena->lock);
+        _drain_remote_frees(arena);
+        block = _sbrk_aligned_malloc(arena, block_size, alignment);
+        pthread_mutex_unlock(&arena->lock);
+    }
+    if (block == nullptr) {
+        block = _mmap_aligned_malloc(arena, block_size, alignment);
+    }
+    if (block == nullptr) {
+        return nullptr;
+    }
+    if (sampled) {
+        _profile_record(PAYLOAD_OF(block), size);
+    }
+    return PAYLOAD_OF(block);
+}
+
+// The number of bytes that can be used at p, at least the size it was allocated with
+size_t smalloc_usable_size(void* p)
+{
+    if (p == nullptr) {
+        return 0;
+    }
+    if (IS_SLAB_PTR(p)) {
+        return SLAB_OF(p)->slot_size;
+    }
+    if (IS_ALIGNED_TAG(BLOCK_OF(p))) {
+        size_t offset = ALIGNED_OFFSET(BLOCK_OF(p));
+        return smalloc_usable_size((uint8_t*)p - offset) - offset;
+    }
+    // The rest of the last page of a mapping is usable as well, srealloc grows into it in place
+    if (IS_MMAP_BLOCK(BLOCK_OF(p))) {
+        return MMAP_END(BLOCK_OF(p)) - (uint8_t*)p;
+    }
+    return BLOCK_SIZE(BLOCK_OF(p)) - _size_meta_data();
+}
+
+void _mmap_free(head_metadata_t* block_to_free)
+{
+    arena_t* arena = BLOCK_ARENA(block_to_free);
+    pthread_mutex_lock(&arena->lock);
+    arena->allocated_blocks_num--;
+    arena->allocated_bytes_num -= BLOCK_SIZE(block_to_free) - _size_meta_data();
+    pthread_mutex_unlock(&arena->lock);
+    if (!IS_HUGE_PAGE(block_to_free)) {
+        // Marked free so freeing it again while it is cached is caught
+        _set_flags(block_to_free, HEADER(block_to_free) | FREE_BIT);
+        if (_mmap_cache_put(MMAP_START(block_to_free), MMAP_END(block_to_free) - MMAP_START(block_to_free))) {
+            return;
+        }
+    }
+    munmap(MMAP_START(block_to_free), MMAP_END(block_to_free) - MMAP_START(block_to_free));
+}
+
+void sfree(void* p)
+{
+    if (p == nullptr) {
+        return;
+    }
+    if (IS_SLAB_PTR(p)) {
+        if (_check_freed_slot(p)) {
+            _tcache_free(p, SLAB_OF(p)->slot_size);
+        }
+        return;
+    }
+    if (IS_ALIGNED_TAG(BLOCK_OF(p))) {
+        sfree((uint8_t*)p - ALIGNED_OFFSET(BLOCK_OF(p)));
+        return;
+    }
+    head_metadata_t* block_to_free = BLOCK_OF(p);
+    if (!_check_freed_block(block_to_free)) {
+        return;
+    }
+    if (IS_SAMPLED(block_to_free)) {
+        _profile_free(block_to_free);
+    }
+    if (IS_MMAP_BLOCK(block_to_free)) {
+        _mmap_free(block_to_free);
+    } else if (IS_TCACHE_SIZE(BLOCK_SIZE(block_to_free) - _size_meta_data())) {
+        _tcache_free(p, BLOCK_SIZE(block_to_free) - _size_meta_data());
+    } else if (BLOCK_ARENA(block_to_free) != _thread_arena()) {
+        _remote_free(BLOCK_ARENA(block_to_free), p);
+    } else {
+        arena_t* arena = BLOCK_ARENA(block_to_free);
+        pthread_mutex_lock(&arena->lock);
+        _heap_free(arena, block_to_free);
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+static int _compare_ptrs(const void* a, const void* b)
+{
+    uintptr_t left = *(const uintptr_t*)a;
+    uintptr_t right = *(const uintptr_t*)b;
+    return (left > right) - (left < right);
+}
+
+// Returns the block of p if sfree_batch frees it under the lock, a heap block of the calling thread's
+// arena that is too big for the thread cache. Sampled blocks are left to sfree
+static head_metadata_t* _batch_free_block(arena_t* arena, void* p)
+{
+    if (IS_SLAB_PTR(p) || IS_ALIGNED_TAG(BLOCK_OF(p))) {
+        return nullptr;
+    }
+    head_metadata_t* block = BLOCK_OF(p);
+    if (IS_MMAP_BLOCK(block) || IS_TCACHE_SIZE(BLOCK_SIZE(block) - _size_meta_data()) || BLOCK_ARENA(block) != arena || IS_SAMPLED(block)) {
+        return nullptr;
+    }
+    return block;
+}
+
+// Frees the heap blocks of the arena in ptrs under one lock. With the sbrk engine they are sorted by
+// address and blocks next to each other are joined first, so every run of them is merged and added
+// to the bins once
+static void _sfree_batch_locked(arena_t* arena, void** ptrs, size_t n)
+{
+    pthread_mutex_lock(&arena->lock);
+    if (heap_engine == BUDDY_ENGINE) {
+        for (size_t i = 0; i < n; i++) {
+            if (_check_freed_block(BLOCK_OF(ptrs[i]))) {
+                _buddy_free(arena, BLOCK_OF(ptrs[i]));
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+        return;
+    }
+    qsort(ptrs, n, sizeof(void*), _compare_ptrs);
+    size_t i = 0;
+    while (i < n) {
+        // Double frees and pointers that appear twice are skipped
+        if ((i > 0 && ptrs[i] == ptrs[i - 1]) || !_check_freed_block(BLOCK_OF(ptrs[i]))) {
+            i++;
+            continue;
+        }
+        head_metadata_t* run = BLOCK_OF(ptrs[i]);
+        size_t run_size = BLOCK_SIZE(run);
+        for (i++; i < n && (void*)BLOCK_OF(ptrs[i]) == (uint8_t*)run + run_size && _check_freed_block(BLOCK_OF(ptrs[i])); i++) {
+            run_size += BLOCK_SIZE(BLOCK_OF(ptrs[i]));
+            arena->allocated_blocks_num--;
+            arena->allocated_bytes_num += _size_meta_data();
+        }
+        _resize_block(run, run_size);
+        _sbrk_free(arena, run);
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+// Frees n pointers, the heap blocks of the calling thread's arena under one lock per FREE_BATCH_CHUNK
+// pointers and the rest one by one. They are copied to the stack to be sorted, ptrs is left as is
+void sfree_batch(void** ptrs, size_t n)
+{
+    arena_t* arena = _thread_arena();
+    void* batch[FREE_BATCH_CHUNK];
+    for (size_t start = 0; start < n; start += FREE_BATCH_CHUNK) {
+        size_t end = (n - start > FREE_BATCH_CHUNK) ? start + FREE_BATCH_CHUNK : n;
+        size_t count = 0;
+        for (size_t i = start; i < end; i++) {
+            if (ptrs[i] == nullptr) {
+                continue;
+            }
+            if (_batch_free_block(arena, ptrs[i])) {
+                batch[count++] = ptrs[i];
+            } else {
+                sfree(ptrs[i]);
+            }
+        }
+        if (count != 0) {
+            _sfree_batch_locked(arena, batch, count);
+        }
+    }
+}
+
+// Like sfree but size, the size p was allocated or last reallocated with, picks the route. Sizes of
+// the thread cache go straight to it, the rest are freed by sfree. Above CHECK_NONE the block is
+// looked at to reject a size it can't hold, sfree frees it then. p must not come from saligned_alloc
+void sfree_sized(void* p, size_t size)
+{
+    size = _align_size(size);
+    if (p == nullptr || size == 0 || !IS_TCACHE_SIZE(size)) {
+        sfree(p);
+        return;
+    }
+    if ((IS_SLAB_PTR(p)) ? !_check_freed_slot(p) : !_check_freed_block(BLOCK_OF(p))) {
+        return;
+    }
+    // A mismatched size goes by the header instead. A sampled allocation of a thread cache size is a
+    // heap block
+    if (!_check_freed_size(p, size) || (profile_period && !IS_SLAB_PTR(p) && IS_SAMPLED(BLOCK_OF(p)))) {
+        sfree(p);
+        return;
+    }
+    _tcache_free(p, size);
+}
+
+// On failure block_ptr is updated since the block may have been merged with its neighbors
+static void* _sbrk_realloc(arena_t* arena, head_metadata_t** block_ptr, size_t block_size)
+{
+    head_metadata_t* block = *block_ptr;
+    void* heap_break = _heap_sbrk(arena, 0);
+    // Try to reuse the same block
+    if (BLOCK_SIZE(block) >= block_size) {
+        goto split_block_if_needed;
+    }
+    // Try to merge with lower address
+    block = _merge_sbrk_blocks(arena, block, true, false, true);
+    if (BLOCK_SIZE(block) >= block_size) {
+        goto split_block_if_needed;
+    }
+    // Is wilderness block
+    if ((void*)NEXT_BLOCK(block) == heap_break) {
+        size_t delta = block_size - BLOCK_SIZE(block);
+        if (_wilderness_sbrk_block_increase(arena, block, block_size) == nullptr) {
+            goto realloc_failed;
+        }
+        arena->allocated_bytes_num += delta;
+        return PAYLOAD_OF(block);
+    }
+    // Try to merge with higher address
+    block = _merge_sbrk_blocks(arena, block, false, true, false);
+    if (BLOCK_SIZE(block) >= block_size) {
+        goto split_block_if_needed;
+    }
+    // Try to merge 3 block all toghether
+    block = _merge_sbrk_blocks(arena, block, true, true, true);
+    if (BLOCK_SIZE(block) >= block_size) {
+        goto split_block_if_needed;
+    }
+    // Is wilderness block
+    if ((void*)NEXT_BLOCK(block) == heap_break) {
+        size_t delta = block_size - BLOCK_SIZE(block);
+        if (_wilderness_sbrk_block_increase(arena, block, block_size) == nullptr) {
+            goto realloc_failed;
+        }
+        arena->allocated_bytes_num += delta;
+        return PAYLOAD_OF(block);
+    }
+    // If non of the options worked just allocate and copy to new block
+realloc_failed:
+    *block_ptr = block;
+    return nullptr;
+
+split_block_if_needed:
+    if (IS_REDUNDANT(block, block_size)) {
+        arena->free_blocks_num++;
+        arena->free_bytes_num += BLOCK_SIZE(block) - block_size - _size_meta_data();
+        arena->allocated_blocks_num++;
+        arena->allocated_bytes_num -= _size_meta_data();
+        size_t prev_size = BLOCK_SIZE(block);
+        _init_sbrk_alloc_block(arena, block, block_size, false);
+        _init_sbrk_free_block(arena, (head_metadata_t*)((uint8_t*)block + block_size), prev_size - block_size);
+    }
+    return PAYLOAD_OF(block);
+}
+
+// srealloc charged the profiler for the call, the allocations here don't charge it again
+static void* _srealloc(void* oldp, size_t size)
+{
+    void* newp;
+    size = _align_size(size);
     if (size == 0 || size > SIZE_LIMIT) {
         return nullptr;
     }
-    size_t block_size = size + _size_meta_data();
-    if (IS_SBRK_ALLOC(old_block)) {
-        newp = _sbrk_realloc(old_block, block_size);
+    if (oldp == nullptr) {
+        return _smalloc_uncharged(size);
+    }
+    if (IS_SLAB_PTR(oldp)) {
+        size_t slot_size = SLAB_OF(oldp)->slot_size;
+        if (size <= slot_size) {
+            return oldp;
+        }
+        newp = _smalloc_uncharged(size);
+        if (newp == nullptr) {
+            return nullptr;
+        }
+        memmove(newp, oldp, slot_size);
+        sfree(oldp);
+        return newp;
+    }
+    if (IS_ALIGNED_TAG(BLOCK_OF(oldp))) {
+        size_t old_size = smalloc_usable_size(oldp);
+        newp = _smalloc_uncharged(size);
+        if (newp == nullptr) {
+            return nullptr;
+        }
+        memmove(newp, oldp, (old_size < size) ? old_size : size);
+        sfree(oldp);
+        return newp;
+    }
+    head_metadata_t* old_block = BLOCK_OF(oldp);
+    size_t block_size = _block_size_of(size);
+    if (IS_BUDDY_PTR(old_block)) {
+        if (BLOCK_SIZE(old_block) >= block_size) {
+            return oldp;
+        }
+    } else if (IS_SBRK_ALLOC(old_block) && ALLOC_SBRK(block_size)) {
+        arena_t* arena = BLOCK_ARENA(old_block);
+        pthread_mutex_lock(&arena->lock);
+        newp = _sbrk_realloc(arena, &old_block, block_size);
+        pthread_mutex_unlock(&arena->lock);
         if (newp) {
             return newp;
         }
+        oldp = PAYLOAD_OF(old_block);
+    }
+    size_t old_size = BLOCK_SIZE(old_block) - _size_meta_data();
+    if (BLOCK_SIZE(old_block) == block_size) {
+        return oldp;
     }
-    if (old_block->size == block_size) {
+    // Growing into the rest of the last page of a mapping needs no call at all
+    if (IS_MMAP_BLOCK(old_block) && block_size > BLOCK_SIZE(old_block) && block_size <= (size_t)(MMAP_END(old_block) - (uint8_t*)old_block)) {
+        arena_t* arena = BLOCK_ARENA(old_block);
+        pthread_mutex_lock(&arena->lock);
+        arena->allocated_bytes_num += block_size - BLOCK_SIZE(old_block);
+        _resize_block(old_block, block_size);
+        pthread_mutex_unlock(&arena->lock);
         return oldp;
     }
-    if (!IS_SBRK_ALLOC(old_block) && old_block->next == (head_metadata_t*)HUGE_PAGE) {
+    if (IS_MMAP_BLOCK(old_block) && !IS_HUGE_PAGE(old_block) && !ALLOC_SBRK(block_size) && block_size < HUGE_PAGE_LIMIT) {
+        head_metadata_t* block = _mmap_remap(old_block, block_size);
+        if (block) {
+            return PAYLOAD_OF(block);
+        }
+    }
+    if (IS_MMAP_BLOCK(old_block) && IS_HUGE_PAGE(old_block)) {
         head_metadata_t* block;
-        block = _mmap_malloc(block_size, true);
+        block = _mmap_malloc(_thread_arena(), block_size, true);
         if (block == nullptr) {
             return nullptr;
         }
-        newp = (block) ? (void*)((uint8_t*)block + sizeof(head_metadata_t)) : nullptr;
+        newp = (block) ? PAYLOAD_OF(block) : nullptr;
     } else {
-        newp = smalloc(size);
+        newp = _smalloc_uncharged(size);
     }
     if (newp == nullptr) {
         return nullptr;
     }
-    memmove(newp, oldp, size);
+    memmove(newp, oldp, (old_size < size) ? old_size : size);
     sfree(oldp);
     return newp;
 }
+
+// A buffer that keeps growing, like a string appended to, would otherwise be copied on almost every
+// call. Its first growth is tracked and every growth after that is over-provisioned
+static void* _realloc_growing(void* oldp, size_t size)
+{
+    size = _align_size(size);
+    if (oldp == nullptr || size == 0 || size > SIZE_LIMIT) {
+        return _srealloc(oldp, size);
+    }
+    realloc_growth_t* growth = REALLOC_GROWTH_OF(oldp);
+    bool regrowth = growth->p == oldp && size >= growth->size;
+    size_t usable_size = smalloc_usable_size(oldp);
+    if (regrowth && size <= usable_size) {
+        growth->size = size;
+        // The header of a mapping has to cover the part of its page slack that is used
+        bool mapping = !IS_SLAB_PTR(oldp) && IS_MMAP_BLOCK(BLOCK_OF(oldp)) && !IS_ALIGNED_TAG(BLOCK_OF(oldp));
+        if (mapping && _block_size_of(size) > BLOCK_SIZE(BLOCK_OF(oldp))) {
+            return _srealloc(oldp, size);
+        }
+        return oldp;
+    }
+    if (growth->p == oldp) {
+        growth->p = nullptr;
+    }
+    size_t provision = size;
+    if (regrowth) {
+        // The slack never turns the block into a huge page block
+        size_t limit = (_block_size_of(size) < HUGE_PAGE_LIMIT) ? HUGE_PAGE_LIMIT - _size_meta_data() - PAYLOAD_ALIGNMENT : (size_t)SIZE_LIMIT;
+        provision = (size + REALLOC_SLACK(size) < limit) ? size + REALLOC_SLACK(size) : limit;
+    }
+    void* newp = _srealloc(oldp, provision);
+    if (newp && size > usable_size) {
+        growth = REALLOC_GROWTH_OF(newp);
+        growth->p = newp;
+        growth->size = size;
+    }
+    return newp;
+}
+
+// The profiler sees a reallocation as a free of the old allocation and a new one of size bytes, it is
+// charged once for the call. The sample of the old block is only counted as freed if the call succeeds
+void* srealloc(void* oldp, size_t size)
+{
+    bool sampled = __builtin_expect(PROFILE_CHARGE(size), 0) && _profile_next_sample();
+    profile_sample_t detached;
+    bool old_sampled = profile_period && oldp && !IS_SLAB_PTR(oldp) && !IS_ALIGNED_TAG(BLOCK_OF(oldp)) && IS_SAMPLED(BLOCK_OF(oldp)) && _profile_detach(BLOCK_OF(oldp), &detached);
+    void* newp = _realloc_growing(oldp, size);
+    if (old_sampled) {
+        _profile_settle(&detached, (newp) ? nullptr : BLOCK_OF(oldp));
+    }
+    if (sampled && newp) {
+        _profile_record(newp, size);
+    }
+    return newp;
+}
+
+// Frees the pooled region chunks, returns true if there were any
+static bool _flush_region_pool()
+{
+    pthread_mutex_lock(&region_pool.lock);
+    region_chunk_t* chunks = region_pool.chunks;
+    region_pool.chunks = nullptr;
+    region_pool.chunks_num = 0;
+    pthread_mutex_unlock(&region_pool.lock);
+    bool released = chunks != nullptr;
+    while (chunks) {
+        region_chunk_t* next = chunks->next;
+        sfree(chunks);
+        chunks = next;
+    }
+    return released;
+}
+
+static region_chunk_t* _get_region_chunk()
+{
+    pthread_mutex_lock(&region_pool.lock);
+    region_chunk_t* chunk = region_pool.chunks;
+    if (chunk) {
+        region_pool.chunks = chunk->next;
+        region_pool.chunks_num--;
+    }
+    pthread_mutex_unlock(&region_pool.lock);
+    if (chunk == nullptr) {
+        chunk = (region_chunk_t*)smalloc(REGION_CHUNK_SIZE - _size_meta_data());
+    }
+    return chunk;
+}
+
+sregion_t* sregion_create()
+{
+    sregion_t* region = (sregion_t*)smalloc(sizeof(sregion_t));
+    if (region) {
+        memset(region, 0, sizeof(sregion_t));
+    }
+    return region;
+}
+
+// No header and no cookie, the memory is only given back by sregion_reset and sregion_destroy
+void* sregion_alloc(sregion_t* region, size_t size)
+{
+    if (size == 0 || size > SIZE_LIMIT) {
+        return nullptr;
+    }
+    size = ALIGN_UP(size, PAYLOAD_ALIGNMENT);
+    if ((size_t)(region->limit - region->cursor) >= size) {
+        void* p = region->cursor;
+        region->cursor += size;
+        return p;
+    }
+    if (size > REGION_LARGE_SIZE) {
+        region_chunk_t* block = (region_chunk_t*)smalloc(REGION_CHUNK_HEADER_SIZE + size);
+        if (block == nullptr) {
+            return nullptr;
+        }
+        block->next = region->large_blocks;
+        region->large_blocks = block;
+        return REGION_DATA(block);
+    }
+    region_chunk_t* chunk = _get_region_chunk();
+    if (chunk == nullptr) {
+        return nullptr;
+    }
+    if (region->chunks == nullptr) {
+        region->last_chunk = chunk;
+    }
+    chunk->next = region->chunks;
+    region->chunks = chunk;
+    region->chunks_num++;
+    region->cursor = REGION_DATA(chunk) + size;
+    region->limit = (uint8_t*)chunk + REGION_CHUNK_SIZE - _size_meta_data();
+    return REGION_DATA(chunk);
+}
+
+// Frees everything allocated from the region. The newest chunk stays with the region and the rest
+// are moved to the pool at once, only the large blocks are freed one by one
+void sregion_reset(sregion_t* region)
+{
+    while (region->large_blocks) {
+        region_chunk_t* next = region->large_blocks->next;
+        sfree(region->large_blocks);
+        region->large_blocks = next;
+    }
+    if (region->chunks == nullptr) {
+        return;
+    }
+    region_chunk_t* chunks = region->chunks->next;
+    region_chunk_t* last_chunk = region->last_chunk;
+    size_t chunks_num = region->chunks_num - 1;
+    region->chunks->next = nullptr;
+    region->last_chunk = region->chunks;
+    region->chunks_num = 1;
+    region->cursor = REGION_DATA(region->chunks);
+    if (chunks == nullptr) {
+        return;
+    }
+    pthread_mutex_lock(&region_pool.lock);
+    if (region_pool.chunks_num + chunks_num <= REGION_POOL_MAX_CHUNKS) {
+        last_chunk->next = region_pool.chunks;
+        region_pool.chunks = chunks;
+        region_pool.chunks_num += chunks_num;
+        chunks = nullptr;
+    }
+    pthread_mutex_unlock(&region_pool.lock);
+    // The pool is full
+    while (chunks) {
+        region_chunk_t* next = chunks->next;
+        sfree(chunks);
+        chunks = next;
+    }
+}
+
+void sregion_destroy(sregion_t* region)
+{
+    if (region == nullptr) {
+        return;
+    }
+    sregion_reset(region);
+    region_chunk_t* chunk = region->chunks;
+    if (chunk) {
+        pthread_mutex_lock(&region_pool.lock);
+        if (region_pool.chunks_num < REGION_POOL_MAX_CHUNKS) {
+            chunk->next = region_pool.chunks;
+            region_pool.chunks = chunk;
+            region_pool.chunks_num++;
+            chunk = nullptr;
+        }
+        pthread_mutex_unlock(&region_pool.lock);
+        sfree(chunk);
+    }
+    sfree(region);
+}
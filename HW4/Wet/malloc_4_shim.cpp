@@ -0,0 +1,175 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+
+// Exports malloc_4 as the standard malloc family so it can be preloaded into any program:
+//     LD_PRELOAD=./libmalloc_4.so ls
+// Anything the allocator allocates through libc while it initializes (and calls made while the
+// dynamic loader is still running) is served from a static bootstrap buffer and never freed
+#define BOOTSTRAP_SIZE (64 * 1024)
+#define BOOTSTRAP_ALIGNMENT 16
+#define IS_BOOTSTRAP_PTR(p) ((uint8_t*)(p) >= bootstrap && (uint8_t*)(p) < bootstrap + BOOTSTRAP_SIZE)
+#define BOOTSTRAP_SIZE_OF(p) (*(size_t*)((uint8_t*)(p) - BOOTSTRAP_ALIGNMENT))
+
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size);
+void sfree(void* p);
+void sfree_sized(void* p, size_t size);
+void* srealloc(void* oldp, size_t size);
+void* saligned_alloc(size_t alignment, size_t size);
+size_t smalloc_usable_size(void* p);
+
+alignas(BOOTSTRAP_ALIGNMENT) static uint8_t bootstrap[BOOTSTRAP_SIZE];
+static size_t bootstrap_used = 0;
+// Set while a thread is inside of the allocator, a call that finds it set came from libc
+static __thread int allocator_depth = 0;
+
+// Every allocation is preceded by its size, the buffer is only ever bumped
+static void* _bootstrap_malloc(size_t size)
+{
+    size_t length = BOOTSTRAP_ALIGNMENT + (size + BOOTSTRAP_ALIGNMENT - 1) / BOOTSTRAP_ALIGNMENT * BOOTSTRAP_ALIGNMENT;
+    size_t offset = __atomic_fetch_add(&bootstrap_used, length, __ATOMIC_RELAXED);
+    if (offset + length > BOOTSTRAP_SIZE) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    uint8_t* p = bootstrap + offset + BOOTSTRAP_ALIGNMENT;
+    BOOTSTRAP_SIZE_OF(p) = size;
+    return p;
+}
+
+static void* _checked(void* p)
+{
+    if (p == nullptr) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+extern "C" void* malloc(size_t size)
+{
+    if (allocator_depth) {
+        return _bootstrap_malloc(size);
+    }
+    allocator_depth++;
+    // A unique pointer is expected for 0 bytes as well
+    void* p = smalloc((size) ? size : 1);
+    allocator_depth--;
+    return _checked(p);
+}
+
+extern "C" void free(void* p)
+{
+    if (p == nullptr || IS_BOOTSTRAP_PTR(p)) {
+        return;
+    }
+    allocator_depth++;
+    sfree(p);
+    allocator_depth--;
+}
+
+// C23 free_sized, size is the size p was allocated with
+extern "C" void free_sized(void* p, size_t size)
+{
+    if (p == nullptr || IS_BOOTSTRAP_PTR(p)) {
+        return;
+    }
+    allocator_depth++;
+    sfree_sized(p, size);
+    allocator_depth--;
+}
+
+extern "C" void* calloc(size_t num, size_t size)
+{
+    if (size && num > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    if (allocator_depth) {
+        // Never reused, so it is still zeroed
+        return _bootstrap_malloc(num * size);
+    }
+    allocator_depth++;
+    void* p = (num && size) ? scalloc(num, size) : smalloc(1);
+    allocator_depth--;
+    return _checked(p);
+}
+
+extern "C" void* realloc(void* oldp, size_t size)
+{
+    if (oldp == nullptr) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        free(oldp);
+        return nullptr;
+    }
+    if (IS_BOOTSTRAP_PTR(oldp)) {
+        void* newp = malloc(size);
+        if (newp) {
+            size_t old_size = BOOTSTRAP_SIZE_OF(oldp);
+            memcpy(newp, oldp, (old_size < size) ? old_size : size);
+        }
+        return newp;
+    }
+    allocator_depth++;
+    void* newp = srealloc(oldp, size);
+    allocator_depth--;
+    return _checked(newp);
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    if (allocator_depth) {
+        return (alignment <= BOOTSTRAP_ALIGNMENT) ? _bootstrap_malloc(size) : nullptr;
+    }
+    allocator_depth++;
+    void* p = saligned_alloc(alignment, (size) ? size : 1);
+    allocator_depth--;
+    return _checked(p);
+}
+
+extern "C" void* memalign(size_t alignment, size_t size)
+{
+    return aligned_alloc(alignment, size);
+}
+
+extern "C" int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* p = aligned_alloc(alignment, size);
+    if (p == nullptr) {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
+extern "C" void* valloc(size_t size)
+{
+    return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+extern "C" void* pvalloc(size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    return aligned_alloc(page_size, (size + page_size - 1) / page_size * page_size);
+}
+
+extern "C" size_t malloc_usable_size(void* p)
+{
+    if (p == nullptr) {
+        return 0;
+    }
+    if (IS_BOOTSTRAP_PTR(p)) {
+        return BOOTSTRAP_SIZE_OF(p);
+    }
+    return smalloc_usable_size(p);
+}
@@ -0,0 +1,335 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Checks of malloc_4 behavior the benchmarks don't look at, one line of CSV per test. The engine is
+// picked by MALLOC4_ENGINE as usual, "make test" runs them with both engines and at the CHECK_FULL and
+// CHECK_FREE check levels. The exit status is the number of tests that failed
+#define DOUBLE_FREE_SIZES { 16, 200, 400, 2000 } // slab slots, a cached heap block and a heap block
+#define DOUBLE_FREE_SLOT_SIZE 48
+#define DOUBLE_FREE_SLOTS_NUM 256 // more than the thread cache keeps, most go back to their slabs
+#define LARGE_HEAP_SIZE ((size_t)300 * 1024 * 1024) // more than the buddy regions used to hold
+#define LARGE_HEAP_BLOCK_SIZE (60 * 1000) // a 64KB buddy block, below the mmap threshold
+#define FREE_BATCH_SIZES { 24, 600, 3000 } // slab slots and heap blocks, freed in reverse order
+#define FREE_BATCH_NUM 1000 // a few of sfree_batch's chunks
+#define ALIGNMENT 16 // alignof(max_align_t), what the drop-in library has to return
+#define ALIGNMENT_SIZES_LIMIT (8 * 1024 * 1024) // slots, heap blocks, buddy blocks and mappings
+#define REGION_SIZES_LIMIT (20 * 1024) // bumped from chunks and large blocks of their own
+#define SCALLOC_SIZES { 24, 400, 3000, 100 * 1000, 4 * 1024 * 1024 } // slots, heap blocks and mappings
+#define SCALLOC_DIRT 0xa5
+#define ALIGNED_ALLOC_SIZES { 1, 100, 3000, 200 * 1000 } // from the heap and mapped
+#define ALIGNED_ALLOC_ALIGNMENT_LIMIT (1024 * 1024)
+#define REGION_ALLOCS_NUM 200 // a few chunks and large blocks
+#define REGION_SIZES { 8, 40, 300, 5000, 30 * 1000 }
+#define TRIM_SIZES { 400, 3000 } // a cached heap block and a heap block
+#define TRIM_BLOCKS_NUM 64 // more than the thread cache keeps of a size
+#define FREE_SIZED_SLOT_SIZES { 16, 48, 200 }
+#define FREE_SIZED_WRONG_SIZE 400 // a cached size bigger than any of the slots
+
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size);
+void sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+void* saligned_alloc(size_t alignment, size_t size);
+void sfree_sized(void* p, size_t size);
+void sfree_batch(void** ptrs, size_t n);
+typedef struct sregion sregion_t;
+sregion_t* sregion_create();
+void* sregion_alloc(sregion_t* region, size_t size);
+void sregion_reset(sregion_t* region);
+void sregion_destroy(sregion_t* region);
+int smalloc_trim(size_t pad);
+size_t _num_allocated_blocks();
+size_t _num_allocated_bytes();
+size_t _num_meta_data_bytes();
+
+typedef struct {
+    const char* name;
+    bool (*run)();
+} test_t;
+
+// A second free of a pointer is ignored, so it is never handed out twice
+static bool _test_double_free()
+{
+    size_t sizes[] = DOUBLE_FREE_SIZES;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        void* p = smalloc(sizes[i]);
+        sfree(p);
+        sfree(p);
+        void* first = smalloc(sizes[i]);
+        void* second = smalloc(sizes[i]);
+        bool ok = first != second;
+        sfree(first);
+        sfree(second);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool _test_double_free_sized()
+{
+    size_t sizes[] = DOUBLE_FREE_SIZES;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        void* p = smalloc(sizes[i]);
+        sfree_sized(p, sizes[i]);
+        sfree_sized(p, sizes[i]);
+        void* first = smalloc(sizes[i]);
+        void* second = smalloc(sizes[i]);
+        bool ok = first != second;
+        sfree(first);
+        sfree(second);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Slots that went back to their slab are caught by its bitmap, the cached ones by their mark
+static bool _test_double_free_slab()
+{
+    void* slots[DOUBLE_FREE_SLOTS_NUM * 2];
+    for (size_t i = 0; i < DOUBLE_FREE_SLOTS_NUM; i++) {
+        slots[i] = smalloc(DOUBLE_FREE_SLOT_SIZE);
+    }
+    for (size_t i = 0; i < DOUBLE_FREE_SLOTS_NUM; i++) {
+        sfree(slots[i]);
+    }
+    for (size_t i = 0; i < DOUBLE_FREE_SLOTS_NUM; i++) {
+        sfree(slots[i]);
+    }
+    for (size_t i = 0; i < DOUBLE_FREE_SLOTS_NUM * 2; i++) {
+        slots[i] = smalloc(DOUBLE_FREE_SLOT_SIZE);
+    }
+    void* sorted[DOUBLE_FREE_SLOTS_NUM * 2];
+    std::copy(slots, slots + DOUBLE_FREE_SLOTS_NUM * 2, sorted);
+    std::sort(sorted, sorted + DOUBLE_FREE_SLOTS_NUM * 2);
+    bool ok = std::adjacent_find(sorted, sorted + DOUBLE_FREE_SLOTS_NUM * 2) == sorted + DOUBLE_FREE_SLOTS_NUM * 2;
+    for (size_t i = 0; i < DOUBLE_FREE_SLOTS_NUM * 2; i++) {
+        sfree(slots[i]);
+    }
+    return ok;
+}
+
+// sfree_batch frees everything it is given but leaves the caller's array as it was. The blocks it
+// freed take the same batch again without growing the heap
+static bool _test_free_batch_keeps_ptrs()
+{
+    size_t sizes[] = FREE_BATCH_SIZES;
+    void* ptrs[FREE_BATCH_NUM];
+    void* copy[FREE_BATCH_NUM];
+    for (size_t i = 0; i < FREE_BATCH_NUM; i++) {
+        ptrs[FREE_BATCH_NUM - 1 - i] = smalloc(sizes[i % (sizeof(sizes) / sizeof(sizes[0]))]);
+    }
+    std::copy(ptrs, ptrs + FREE_BATCH_NUM, copy);
+    size_t heap_bytes = _num_allocated_bytes() + _num_meta_data_bytes();
+    sfree_batch(ptrs, FREE_BATCH_NUM);
+    bool ok = std::equal(ptrs, ptrs + FREE_BATCH_NUM, copy);
+    for (size_t i = 0; i < FREE_BATCH_NUM; i++) {
+        ptrs[FREE_BATCH_NUM - 1 - i] = smalloc(sizes[i % (sizeof(sizes) / sizeof(sizes[0]))]);
+    }
+    ok &= _num_allocated_bytes() + _num_meta_data_bytes() == heap_bytes;
+    sfree_batch(ptrs, FREE_BATCH_NUM);
+    return ok;
+}
+
+// The heap of an arena is not capped below what the system can give, whichever the engine
+static bool _test_large_heap()
+{
+    size_t blocks_num = LARGE_HEAP_SIZE / LARGE_HEAP_BLOCK_SIZE + 1;
+    void** blocks = (void**)smalloc(blocks_num * sizeof(void*));
+    if (blocks == nullptr) {
+        return false;
+    }
+    size_t count = 0;
+    while (count < blocks_num && (blocks[count] = smalloc(LARGE_HEAP_BLOCK_SIZE))) {
+        count++;
+    }
+    for (size_t i = 0; i < count; i++) {
+        sfree(blocks[i]);
+    }
+    sfree(blocks);
+    return count == blocks_num;
+}
+
+// Every kind of block hands out payloads aligned like glibc's, whatever the size asked for
+static bool _test_alignment()
+{
+    bool ok = true;
+    for (size_t size = 1; size <= ALIGNMENT_SIZES_LIMIT; size += (size < 1024) ? 1 : size / 3) {
+        void* p = smalloc(size);
+        void* zeroed = scalloc(1, size);
+        ok &= (uintptr_t)p % ALIGNMENT == 0 && (uintptr_t)zeroed % ALIGNMENT == 0;
+        p = srealloc(p, size * 2 + 1);
+        ok &= (uintptr_t)p % ALIGNMENT == 0;
+        sfree(p);
+        sfree(zeroed);
+    }
+    return ok;
+}
+
+// Region allocations are aligned like every other allocation, bumped or large
+static bool _test_region_alignment()
+{
+    sregion_t* region = sregion_create();
+    if (region == nullptr) {
+        return false;
+    }
+    bool ok = true;
+    for (size_t size = 1; size <= REGION_SIZES_LIMIT; size += (size < 64) ? 1 : size / 4) {
+        void* p = sregion_alloc(region, size);
+        ok &= p != nullptr && ((uintptr_t)p & (ALIGNMENT - 1)) == 0;
+    }
+    sregion_destroy(region);
+    return ok;
+}
+
+static bool _is_zeroed(void* p, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        if (((uint8_t*)p)[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// scalloc zeroes a block it reuses and trusts one it knows is fresh, both come back zeroed
+static bool _test_scalloc_zeroed()
+{
+    size_t sizes[] = SCALLOC_SIZES;
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        void* dirty = smalloc(sizes[i]);
+        memset(dirty, SCALLOC_DIRT, sizes[i]);
+        sfree(dirty);
+        void* reused = scalloc(1, sizes[i]);
+        void* fresh = scalloc(1, sizes[i]);
+        ok &= reused != nullptr && _is_zeroed(reused, sizes[i]);
+        ok &= fresh != nullptr && _is_zeroed(fresh, sizes[i]);
+        sfree(reused);
+        sfree(fresh);
+    }
+    return ok;
+}
+
+// saligned_alloc honors every alignment, from the heap or mapped, whichever the engine
+static bool _test_aligned_alloc()
+{
+    size_t sizes[] = ALIGNED_ALLOC_SIZES;
+    bool ok = true;
+    for (size_t alignment = ALIGNMENT * 2; alignment <= ALIGNED_ALLOC_ALIGNMENT_LIMIT; alignment *= 2) {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            void* p = saligned_alloc(alignment, sizes[i]);
+            ok &= p != nullptr && (uintptr_t)p % alignment == 0;
+            if (p) {
+                memset(p, 0, sizes[i]);
+            }
+            sfree(p);
+        }
+    }
+    return ok;
+}
+
+// Region allocations don't overlap, and after a reset the same allocations take the chunks and
+// memory the region already has instead of growing the heap
+static bool _test_region_reset()
+{
+    size_t sizes[] = REGION_SIZES;
+    void* ptrs[REGION_ALLOCS_NUM];
+    sregion_t* region = sregion_create();
+    if (region == nullptr) {
+        return false;
+    }
+    bool ok = true;
+    size_t heap_bytes = 0;
+    for (size_t round = 0; round < 2; round++) {
+        for (size_t i = 0; i < REGION_ALLOCS_NUM; i++) {
+            ptrs[i] = sregion_alloc(region, sizes[i % (sizeof(sizes) / sizeof(sizes[0]))]);
+            if (ptrs[i] == nullptr) {
+                sregion_destroy(region);
+                return false;
+            }
+            memset(ptrs[i], (uint8_t)i, sizes[i % (sizeof(sizes) / sizeof(sizes[0]))]);
+        }
+        for (size_t i = 0; i < REGION_ALLOCS_NUM; i++) {
+            size_t size = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+            ok &= ((uint8_t*)ptrs[i])[0] == (uint8_t)i && ((uint8_t*)ptrs[i])[size - 1] == (uint8_t)i;
+        }
+        if (round == 0) {
+            heap_bytes = _num_allocated_bytes() + _num_meta_data_bytes();
+        } else {
+            ok &= _num_allocated_bytes() + _num_meta_data_bytes() == heap_bytes;
+        }
+        sregion_reset(region);
+    }
+    sregion_destroy(region);
+    return ok;
+}
+
+// Trimming gives back the cached blocks and the top of the heap, which merges and drops blocks
+static bool _test_trim()
+{
+    size_t sizes[] = TRIM_SIZES;
+    void* blocks[TRIM_BLOCKS_NUM];
+    for (size_t i = 0; i < TRIM_BLOCKS_NUM; i++) {
+        blocks[i] = smalloc(sizes[i % (sizeof(sizes) / sizeof(sizes[0]))]);
+    }
+    for (size_t i = 0; i < TRIM_BLOCKS_NUM; i++) {
+        sfree(blocks[i]);
+    }
+    size_t blocks_num = _num_allocated_blocks();
+    size_t heap_bytes = _num_allocated_bytes() + _num_meta_data_bytes();
+    smalloc_trim(0);
+    return _num_allocated_blocks() < blocks_num && _num_allocated_bytes() + _num_meta_data_bytes() <= heap_bytes;
+}
+
+// A slot freed with a size it can't hold is freed by its slab, never cached for that size
+static bool _test_free_sized_mismatch()
+{
+    size_t sizes[] = FREE_SIZED_SLOT_SIZES;
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        void* p = smalloc(sizes[i]);
+        sfree_sized(p, FREE_SIZED_WRONG_SIZE);
+        void* wrong = smalloc(FREE_SIZED_WRONG_SIZE);
+        void* right = smalloc(sizes[i]);
+        ok &= wrong != p && right == p;
+        sfree(wrong);
+        sfree(right);
+    }
+    return ok;
+}
+
+static const test_t tests[] = {
+    { "double_free", _test_double_free },
+    { "double_free_sized", _test_double_free_sized },
+    { "double_free_slab", _test_double_free_slab },
+    { "free_batch_keeps_ptrs", _test_free_batch_keeps_ptrs },
+    { "large_heap", _test_large_heap },
+    { "alignment", _test_alignment },
+    { "region_alignment", _test_region_alignment },
+    { "scalloc_zeroed", _test_scalloc_zeroed },
+    { "aligned_alloc", _test_aligned_alloc },
+    { "region_reset", _test_region_reset },
+    { "trim", _test_trim },
+    { "free_sized_mismatch", _test_free_sized_mismatch },
+};
+
+int main()
+{
+    const char* engine = getenv("MALLOC4_ENGINE");
+    printf("engine,%s\n", (engine && strcmp(engine, "buddy") == 0) ? "buddy" : "sbrk");
+    printf("test,result\n");
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        bool ok = tests[i].run();
+        printf("%s,%s\n", tests[i].name, (ok) ? "ok" : "FAILED");
+        failures += !ok;
+    }
+    return failures;
+}
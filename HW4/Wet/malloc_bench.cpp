@@ -0,0 +1,562 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "malloc_tools.h"
+
+#define MAX_THREADS 64
+#define CONTENTION_OPS (4 * 1000 * 1000)
+#define CONTENTION_LIVE_BLOCKS 64
+#define CONTENTION_MAX_SIZE 512
+#define CONTENTION_LARGE_MAX_SIZE 4096
+#define PRODUCER_CONSUMER_OPS (1000 * 1000)
+#define PRODUCER_CONSUMER_MAX_SIZE 8192
+#define RING_SIZE 1024
+#define SMALL_OBJECTS (1000 * 1000)
+#define SMALL_OBJECT_SIZE 16
+#define SIZED_FREE_ROUNDS (1000 * 1000)
+#define SIZED_FREE_GROUP 16
+#define SIZED_FREE_MAX_SIZE 512 // the thread cache sizes
+#define HEAP_CHURN_OPS (2 * 1000 * 1000)
+#define HEAP_CHURN_LIVE_BLOCKS 4096
+#define HEAP_CHURN_MIN_SIZE 600 // above the thread cache and the slabs
+#define HEAP_CHURN_MAX_SIZE (16 * 1024)
+#define FOOTPRINT_OBJECTS (100 * 1000)
+#define FOOTPRINT_MIN_SIZE 264 // above the slabs
+#define FOOTPRINT_MAX_SIZE 2048
+#define MMAP_CHURN_OPS (100 * 1000)
+#define MMAP_CHURN_LIVE_BLOCKS 8
+#define MMAP_CHURN_SIZE (256 * 1024)
+#define REALLOC_GROWTH_ROUNDS 100
+#define REALLOC_GROWTH_MIN_SIZE (128 * 1024)
+#define REALLOC_GROWTH_MAX_SIZE (4 * 1024 * 1024 - 64 * 1024) // below the huge page blocks
+#define REALLOC_GROWTH_STEP (16 * 1024)
+#define BUILDER_ROUNDS 20
+#define BUILDER_STEP 16
+#define BUILDER_MAX_SIZE (64 * 1024)
+#define SCALLOC_TABLE_OPS 1000
+#define SCRATCH_REQUESTS (20 * 1000)
+#define SCRATCH_ALLOCATIONS 200
+#define SCRATCH_MAX_SIZE 256
+#define NODES_ROUNDS (100 * 1000)
+#define NODES_PER_ROUND 32
+#define NODE_SIZE 640 // above the thread cache
+#define SCALLOC_TABLE_SIZE (8 * 1024 * 1024)
+#define SCALLOC_TABLE_TOUCHED 64
+#define HEAP_TRIM_OBJECTS (100 * 1000)
+#define HEAP_TRIM_MIN_SIZE 600 // above the thread cache and the slabs
+#define HEAP_TRIM_MAX_SIZE 4096
+#define HEAP_TRIM_ROUNDS 100
+#define TLB_WALK_OBJECTS (1000 * 1000)
+#define TLB_WALK_OBJECT_SIZE 64 // slab slots
+#define TLB_WALK_STEPS (20 * 1000 * 1000)
+
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size);
+void sfree(void* p);
+void sfree_sized(void* p, size_t size);
+typedef struct sregion sregion_t;
+sregion_t* sregion_create();
+void* sregion_alloc(sregion_t* region, size_t size);
+void sregion_reset(sregion_t* region);
+void sregion_destroy(sregion_t* region);
+size_t smalloc_batch(size_t size, size_t n, void** out);
+void sfree_batch(void** ptrs, size_t n);
+void* srealloc(void* oldp, size_t size);
+int smalloc_trim(size_t pad);
+size_t _num_allocated_bytes();
+size_t _num_meta_data_bytes();
+size_t _num_mmap_cache_hits();
+size_t _num_mmap_cache_misses();
+size_t _num_arenas();
+size_t _arena_num_free_blocks(size_t index);
+size_t _arena_num_free_bytes(size_t index);
+size_t _arena_num_allocated_blocks(size_t index);
+size_t _arena_num_allocated_bytes(size_t index);
+
+typedef struct contention_args {
+    size_t ops;
+    unsigned int seed;
+} contention_args_t;
+
+// Single producer single consumer ring, the producer allocates and the consumer frees
+typedef struct ring {
+    void* slots[RING_SIZE];
+    size_t head;
+    size_t tail;
+    size_t ops;
+    unsigned int seed;
+} ring_t;
+
+static double _now()
+{
+    return _now_ns() / 1e9;
+}
+
+// Every thread keeps a small window of live blocks, mostly cached sizes with some heap sizes
+static void* _contention_worker(void* arg)
+{
+    contention_args_t* args = (contention_args_t*)arg;
+    void* live[CONTENTION_LIVE_BLOCKS] = { nullptr };
+    for (size_t i = 0; i < args->ops; i++) {
+        size_t slot = rand_r(&args->seed) % CONTENTION_LIVE_BLOCKS;
+        if (live[slot]) {
+            sfree(live[slot]);
+            live[slot] = nullptr;
+            continue;
+        }
+        size_t max_size = (rand_r(&args->seed) % 16 == 0) ? CONTENTION_LARGE_MAX_SIZE : CONTENTION_MAX_SIZE;
+        live[slot] = smalloc(rand_r(&args->seed) % max_size + 1);
+    }
+    for (size_t slot = 0; slot < CONTENTION_LIVE_BLOCKS; slot++) {
+        sfree(live[slot]);
+    }
+    return nullptr;
+}
+
+static void _bench_contention(size_t threads_num)
+{
+    pthread_t threads[MAX_THREADS];
+    contention_args_t args[MAX_THREADS];
+    double start = _now();
+    for (size_t i = 0; i < threads_num; i++) {
+        args[i].ops = CONTENTION_OPS / threads_num;
+        args[i].seed = i + 1;
+        pthread_create(&threads[i], nullptr, _contention_worker, &args[i]);
+    }
+    for (size_t i = 0; i < threads_num; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+    double seconds = _now() - start;
+    printf("contention,%zu,%d,%.3f,%.0f,%zu\n", threads_num, CONTENTION_OPS, seconds, CONTENTION_OPS / seconds, _num_meta_data_bytes());
+}
+
+static void* _producer_worker(void* arg)
+{
+    ring_t* ring = (ring_t*)arg;
+    for (size_t i = 0; i < ring->ops; i++) {
+        void* p = smalloc(rand_r(&ring->seed) % PRODUCER_CONSUMER_MAX_SIZE + 1);
+        size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+            sched_yield();
+        }
+        ring->slots[tail % RING_SIZE] = p;
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    return nullptr;
+}
+
+static void* _consumer_worker(void* arg)
+{
+    ring_t* ring = (ring_t*)arg;
+    for (size_t i = 0; i < ring->ops; i++) {
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head) {
+            sched_yield();
+        }
+        sfree(ring->slots[head % RING_SIZE]);
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+    return nullptr;
+}
+
+// Every block is freed by a different thread than the one that allocated it
+static void _bench_producer_consumer(size_t threads_num)
+{
+    pthread_t threads[MAX_THREADS];
+    static ring_t rings[MAX_THREADS / 2];
+    size_t pairs_num = (threads_num < 2) ? 1 : threads_num / 2;
+    double start = _now();
+    for (size_t i = 0; i < pairs_num; i++) {
+        rings[i].head = 0;
+        rings[i].tail = 0;
+        rings[i].ops = PRODUCER_CONSUMER_OPS / pairs_num;
+        rings[i].seed = i + 1;
+        pthread_create(&threads[2 * i], nullptr, _producer_worker, &rings[i]);
+        pthread_create(&threads[2 * i + 1], nullptr, _consumer_worker, &rings[i]);
+    }
+    for (size_t i = 0; i < 2 * pairs_num; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+    double seconds = _now() - start;
+    printf("producer_consumer,%zu,%d,%.3f,%.0f,%zu\n", 2 * pairs_num, PRODUCER_CONSUMER_OPS, seconds, PRODUCER_CONSUMER_OPS / seconds, _num_meta_data_bytes());
+}
+
+// Many live objects of one small size, the meta data is measured while all of them are live
+static void _bench_small_objects()
+{
+    static void* objects[SMALL_OBJECTS];
+    double start = _now();
+    for (size_t i = 0; i < SMALL_OBJECTS; i++) {
+        objects[i] = smalloc(SMALL_OBJECT_SIZE);
+    }
+    double seconds = _now() - start;
+    size_t meta_data_bytes = _num_meta_data_bytes();
+    for (size_t i = 0; i < SMALL_OBJECTS; i++) {
+        sfree(objects[i]);
+    }
+    printf("small_objects,1,%d,%.3f,%.0f,%zu\n", SMALL_OBJECTS, seconds, SMALL_OBJECTS / seconds, meta_data_bytes);
+}
+
+// Objects of mixed small sizes allocated and deleted in small groups so they stay in the thread
+// cache, the way delete frees them with and without their size
+static void _bench_sized_free(bool sized)
+{
+    void* objects[SIZED_FREE_GROUP];
+    size_t sizes[SIZED_FREE_GROUP];
+    unsigned int seed = 1;
+    for (size_t i = 0; i < SIZED_FREE_GROUP; i++) {
+        sizes[i] = 1 + rand_r(&seed) % SIZED_FREE_MAX_SIZE;
+    }
+    double start = _now();
+    for (size_t round = 0; round < SIZED_FREE_ROUNDS; round++) {
+        for (size_t i = 0; i < SIZED_FREE_GROUP; i++) {
+            objects[i] = smalloc(sizes[i]);
+        }
+        for (size_t i = 0; i < SIZED_FREE_GROUP; i++) {
+            if (sized) {
+                sfree_sized(objects[i], sizes[i]);
+            } else {
+                sfree(objects[i]);
+            }
+        }
+    }
+    double seconds = _now() - start;
+    size_t ops = (size_t)SIZED_FREE_ROUNDS * SIZED_FREE_GROUP;
+    printf("%s,1,%zu,%.3f,%.0f,%zu\n", (sized) ? "free_sized" : "free_unsized", ops, seconds, ops / seconds, _num_meta_data_bytes());
+}
+
+// Random frees and allocations of heap sizes over a large live set, this is where the heap engine
+// splits and coalesces on every operation
+static void _bench_heap_churn()
+{
+    static void* live[HEAP_CHURN_LIVE_BLOCKS];
+    unsigned int seed = 1;
+    double start = _now();
+    for (size_t i = 0; i < HEAP_CHURN_OPS; i++) {
+        size_t slot = rand_r(&seed) % HEAP_CHURN_LIVE_BLOCKS;
+        sfree(live[slot]);
+        live[slot] = smalloc(HEAP_CHURN_MIN_SIZE + rand_r(&seed) % (HEAP_CHURN_MAX_SIZE - HEAP_CHURN_MIN_SIZE));
+    }
+    double seconds = _now() - start;
+    size_t meta_data_bytes = _num_meta_data_bytes();
+    for (size_t slot = 0; slot < HEAP_CHURN_LIVE_BLOCKS; slot++) {
+        sfree(live[slot]);
+        live[slot] = nullptr;
+    }
+    printf("heap_churn,1,%d,%.3f,%.0f,%zu\n", HEAP_CHURN_OPS, seconds, HEAP_CHURN_OPS / seconds, meta_data_bytes);
+}
+
+// Large response sized buffers allocated, filled page by page and freed, every one of them is an
+// mmap block
+static void _bench_mmap_churn()
+{
+    static char* live[MMAP_CHURN_LIVE_BLOCKS];
+    double start = _now();
+    for (size_t i = 0; i < MMAP_CHURN_OPS; i++) {
+        size_t slot = i % MMAP_CHURN_LIVE_BLOCKS;
+        sfree(live[slot]);
+        live[slot] = (char*)smalloc(MMAP_CHURN_SIZE);
+        for (size_t offset = 0; offset < MMAP_CHURN_SIZE; offset += 4096) {
+            live[slot][offset] = (char)i;
+        }
+    }
+    double seconds = _now() - start;
+    size_t meta_data_bytes = _num_meta_data_bytes();
+    for (size_t slot = 0; slot < MMAP_CHURN_LIVE_BLOCKS; slot++) {
+        sfree(live[slot]);
+        live[slot] = nullptr;
+    }
+    printf("mmap_churn,1,%d,%.3f,%.0f,%zu\n", MMAP_CHURN_OPS, seconds, MMAP_CHURN_OPS / seconds, meta_data_bytes);
+}
+
+// A buffer grown step by step the way a vector or a string builder grows it, the new tail is
+// written on every step
+static void _bench_realloc_growth()
+{
+    size_t ops = 0;
+    double start = _now();
+    for (size_t round = 0; round < REALLOC_GROWTH_ROUNDS; round++) {
+        char* buffer = (char*)smalloc(REALLOC_GROWTH_MIN_SIZE);
+        for (size_t size = REALLOC_GROWTH_MIN_SIZE + REALLOC_GROWTH_STEP; size <= REALLOC_GROWTH_MAX_SIZE; size += REALLOC_GROWTH_STEP) {
+            buffer = (char*)srealloc(buffer, size);
+            buffer[size - 1] = (char)size;
+            ops++;
+        }
+        sfree(buffer);
+    }
+    double seconds = _now() - start;
+    printf("realloc_growth,1,%zu,%.3f,%.0f,%zu\n", ops, seconds, ops / seconds, _num_meta_data_bytes());
+}
+
+// Strings built by appending a few bytes at a time, each append grows the buffer to the exact length.
+// Two builders that take turns keep each other off the top of the heap
+static void _bench_builder(size_t builders_num)
+{
+    char* buffers[2];
+    size_t ops = 0;
+    double start = _now();
+    for (size_t round = 0; round < BUILDER_ROUNDS; round++) {
+        for (size_t i = 0; i < builders_num; i++) {
+            buffers[i] = nullptr;
+        }
+        for (size_t size = BUILDER_STEP; size <= BUILDER_MAX_SIZE; size += BUILDER_STEP) {
+            for (size_t i = 0; i < builders_num; i++) {
+                buffers[i] = (char*)srealloc(buffers[i], size);
+                memset(buffers[i] + size - BUILDER_STEP, (int)i, BUILDER_STEP);
+                ops++;
+            }
+        }
+        for (size_t i = 0; i < builders_num; i++) {
+            sfree(buffers[i]);
+        }
+    }
+    double seconds = _now() - start;
+    printf("%s,1,%zu,%.3f,%.0f,%zu\n", (builders_num == 1) ? "builder_single" : "builder_interleaved", ops, seconds, ops / seconds, _num_meta_data_bytes());
+}
+
+// Big zeroed tables of which only a few pages are ever written, like a sparse hash table or a bitmap
+static void _bench_scalloc_table()
+{
+    unsigned int seed = 1;
+    double start = _now();
+    for (size_t i = 0; i < SCALLOC_TABLE_OPS; i++) {
+        char* table = (char*)scalloc(1, SCALLOC_TABLE_SIZE);
+        for (size_t j = 0; j < SCALLOC_TABLE_TOUCHED; j++) {
+            table[rand_r(&seed) % SCALLOC_TABLE_SIZE] = 1;
+        }
+        sfree(table);
+    }
+    double seconds = _now() - start;
+    printf("scalloc_table,1,%d,%.3f,%.0f,%zu\n", SCALLOC_TABLE_OPS, seconds, SCALLOC_TABLE_OPS / seconds, _num_meta_data_bytes());
+}
+
+// Same sized nodes allocated for a request and freed together when it is done, one call per node or
+// one batch call per request
+static void _bench_nodes(bool batch)
+{
+    void* nodes[NODES_PER_ROUND];
+    double start = _now();
+    for (size_t round = 0; round < NODES_ROUNDS; round++) {
+        if (batch) {
+            smalloc_batch(NODE_SIZE, NODES_PER_ROUND, nodes);
+        } else {
+            for (size_t i = 0; i < NODES_PER_ROUND; i++) {
+                nodes[i] = smalloc(NODE_SIZE);
+            }
+        }
+        for (size_t i = 0; i < NODES_PER_ROUND; i++) {
+            *(size_t*)nodes[i] = round;
+        }
+        if (batch) {
+            sfree_batch(nodes, NODES_PER_ROUND);
+        } else {
+            for (size_t i = 0; i < NODES_PER_ROUND; i++) {
+                sfree(nodes[i]);
+            }
+        }
+    }
+    double seconds = _now() - start;
+    size_t ops = (size_t)NODES_ROUNDS * NODES_PER_ROUND;
+    printf("%s,1,%zu,%.3f,%.0f,%zu\n", (batch) ? "nodes_batch" : "nodes_loop", ops, seconds, ops / seconds, _num_meta_data_bytes());
+}
+
+// Per request scratch memory, small allocations that all die when the request is done. Freed one by
+// one or all at once with a region reset
+static void _bench_scratch(bool region)
+{
+    static void* allocations[SCRATCH_ALLOCATIONS];
+    sregion_t* scratch = sregion_create();
+    unsigned int seed = 1;
+    double start = _now();
+    for (size_t request = 0; request < SCRATCH_REQUESTS; request++) {
+        for (size_t i = 0; i < SCRATCH_ALLOCATIONS; i++) {
+            size_t size = 1 + rand_r(&seed) % SCRATCH_MAX_SIZE;
+            allocations[i] = (region) ? sregion_alloc(scratch, size) : smalloc(size);
+            *(size_t*)allocations[i] = request;
+        }
+        if (region) {
+            sregion_reset(scratch);
+        } else {
+            for (size_t i = 0; i < SCRATCH_ALLOCATIONS; i++) {
+                sfree(allocations[i]);
+            }
+        }
+    }
+    double seconds = _now() - start;
+    sregion_destroy(scratch);
+    size_t ops = (size_t)SCRATCH_REQUESTS * SCRATCH_ALLOCATIONS;
+    printf("%s,1,%zu,%.3f,%.0f,%zu\n", (region) ? "scratch_region" : "scratch_malloc", ops, seconds, ops / seconds, _num_meta_data_bytes());
+}
+
+// Counts the data TLB misses of loads by this thread in user space, -1 when the kernel or the
+// machine has no such counter
+static int _open_dtlb_counter()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// The kilobytes of this process that are backed by transparent huge pages
+static long _anon_huge_kb()
+{
+    FILE* file = fopen("/proc/self/smaps_rollup", "r");
+    if (file == nullptr) {
+        return -1;
+    }
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return kb;
+}
+
+// Chases pointers through many small objects in a random order, almost every step lands on another
+// page so the walk is bound by TLB misses unless the slabs are on huge pages
+static void _bench_tlb_walk()
+{
+    static void* objects[TLB_WALK_OBJECTS];
+    unsigned int seed = 1;
+    for (size_t i = 0; i < TLB_WALK_OBJECTS; i++) {
+        objects[i] = smalloc(TLB_WALK_OBJECT_SIZE);
+    }
+    for (size_t i = TLB_WALK_OBJECTS - 1; i > 0; i--) {
+        size_t j = rand_r(&seed) % (i + 1);
+        void* object = objects[i];
+        objects[i] = objects[j];
+        objects[j] = object;
+    }
+    for (size_t i = 0; i < TLB_WALK_OBJECTS; i++) {
+        *(void**)objects[i] = objects[(i + 1) % TLB_WALK_OBJECTS];
+    }
+    int counter = _open_dtlb_counter();
+    long long misses = -1;
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    void* volatile* object = (void* volatile*)objects[0];
+    double start = _now();
+    for (size_t i = 0; i < TLB_WALK_STEPS; i++) {
+        object = (void* volatile*)*object;
+    }
+    double seconds = _now() - start;
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = -1;
+        }
+        close(counter);
+    }
+    long anon_huge_kb = _anon_huge_kb();
+    for (size_t i = 0; i < TLB_WALK_OBJECTS; i++) {
+        sfree(objects[i]);
+    }
+    printf("tlb,objects,steps,seconds,dtlb_load_misses,anon_huge_kb\n");
+    printf("walk,%d,%d,%.3f,%lld,%ld\n", TLB_WALK_OBJECTS, TLB_WALK_STEPS, seconds, misses, anon_huge_kb);
+}
+
+// Trims a heap where every other block is free, so each call has to find tens of thousands of free
+// blocks
+static void _bench_heap_trim()
+{
+    static void* objects[HEAP_TRIM_OBJECTS];
+    unsigned int seed = 1;
+    for (size_t i = 0; i < HEAP_TRIM_OBJECTS; i++) {
+        objects[i] = smalloc(HEAP_TRIM_MIN_SIZE + rand_r(&seed) % (HEAP_TRIM_MAX_SIZE - HEAP_TRIM_MIN_SIZE));
+    }
+    for (size_t i = 0; i < HEAP_TRIM_OBJECTS; i += 2) {
+        sfree(objects[i]);
+    }
+    double start = _now();
+    for (size_t i = 0; i < HEAP_TRIM_ROUNDS; i++) {
+        smalloc_trim(0);
+    }
+    double seconds = _now() - start;
+    for (size_t i = 1; i < HEAP_TRIM_OBJECTS; i += 2) {
+        sfree(objects[i]);
+    }
+    printf("heap_trim,1,%d,%.3f,%.0f,%zu\n", HEAP_TRIM_ROUNDS, seconds, HEAP_TRIM_ROUNDS / seconds, _num_meta_data_bytes());
+}
+
+// Many live heap objects, the heap they grow is compared to the bytes that were asked for
+static void _bench_footprint()
+{
+    static void* objects[FOOTPRINT_OBJECTS];
+    unsigned int seed = 1;
+    size_t payload_bytes = 0;
+    size_t meta_data_bytes = _num_meta_data_bytes();
+    size_t heap_bytes = _heap_bytes();
+    for (size_t i = 0; i < FOOTPRINT_OBJECTS; i++) {
+        size_t size = FOOTPRINT_MIN_SIZE + rand_r(&seed) % (FOOTPRINT_MAX_SIZE - FOOTPRINT_MIN_SIZE);
+        objects[i] = smalloc(size);
+        payload_bytes += size;
+    }
+    meta_data_bytes = _num_meta_data_bytes() - meta_data_bytes;
+    heap_bytes = _heap_bytes() - heap_bytes;
+    for (size_t i = 0; i < FOOTPRINT_OBJECTS; i++) {
+        sfree(objects[i]);
+    }
+    printf("footprint,objects,payload_bytes,meta_data_bytes,heap_bytes\n");
+    printf("heap,%d,%zu,%zu,%zu\n", FOOTPRINT_OBJECTS, payload_bytes, meta_data_bytes, heap_bytes);
+}
+
+int main()
+{
+    const char* engine = getenv("MALLOC4_ENGINE");
+    printf("engine,%s\n", (engine && strcmp(engine, "buddy") == 0) ? "buddy" : "sbrk");
+    const char* thp = getenv("MALLOC4_THP");
+    printf("thp,%s\n", (thp && strcmp(thp, "0") == 0) ? "off" : "on");
+    // Measured first so the heap has not grown yet
+    _bench_footprint();
+    printf("benchmark,threads,ops,seconds,ops_per_sec,meta_data_bytes\n");
+    _bench_small_objects();
+    _bench_sized_free(true);
+    _bench_sized_free(false);
+    _bench_heap_churn();
+    _bench_heap_trim();
+    _bench_mmap_churn();
+    _bench_realloc_growth();
+    _bench_builder(1);
+    _bench_builder(2);
+    _bench_scalloc_table();
+    _bench_nodes(false);
+    _bench_nodes(true);
+    _bench_scratch(false);
+    _bench_scratch(true);
+    size_t threads_nums[] = { 1, 4, 16, 64 };
+    for (size_t i = 0; i < sizeof(threads_nums) / sizeof(threads_nums[0]); i++) {
+        _bench_contention(threads_nums[i]);
+    }
+    for (size_t i = 0; i < sizeof(threads_nums) / sizeof(threads_nums[0]); i++) {
+        _bench_producer_consumer(threads_nums[i]);
+    }
+    // The heap each arena ended up with shows how the threads were spread
+    printf("arena,allocated_blocks,allocated_bytes,free_blocks,free_bytes\n");
+    for (size_t i = 0; i < _num_arenas(); i++) {
+        printf("%zu,%zu,%zu,%zu,%zu\n", i, _arena_num_allocated_blocks(i), _arena_num_allocated_bytes(i), _arena_num_free_blocks(i), _arena_num_free_bytes(i));
+    }
+    printf("mmap_cache,hits,misses\n");
+    printf("total,%zu,%zu\n", _num_mmap_cache_hits(), _num_mmap_cache_misses());
+    _bench_tlb_walk();
+    return 0;
+}
@@ -0,0 +1,359 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "malloc_tools.h"
+#include "malloc_trace.h"
+
+// Replays a trace written by malloc_trace.cpp against the allocator this is linked with, or against
+// glibc when built with REPLAY_GLIBC. The records of all threads are replayed by one thread in
+// timestamp order so every run does the same operations in the same order. Only the allocator
+// calls are timed, the pages of every new block are written outside of that. The peak RSS only
+// counts what grew past the replay's own bookkeeping
+#define OS_PAGE_SIZE 4096
+#define NO_ID UINT32_MAX
+#define IS_FREE_OP(op) ((op) == TRACE_FREE || (op) == TRACE_FREE_SIZED)
+#ifndef REPLAY_ALLOCATOR
+#define REPLAY_ALLOCATOR "malloc"
+#endif
+// The bookkeeping is bump allocated from mappings of its own so neither the measured allocator
+// nor glibc's mallinfo2 ever see it. The trace is read into one that is unmapped once it is
+// turned into ops, the ops and the state of the replay live in the other
+#define BUMP_ARENA_SIZE ((size_t)1 << 36) // 64GB of address space
+#define BUMP_ALIGNMENT 16
+
+typedef struct {
+    uint8_t op;
+    uint32_t id;
+    uint32_t old_id;
+    uint64_t size;
+    uint64_t alignment; // saligned_alloc only
+} replay_op_t;
+
+typedef struct {
+    uint8_t* start;
+    uint8_t* cursor;
+} bump_arena_t;
+
+// Memory is only given back when the whole arena is unmapped
+template <typename T>
+struct bump_allocator {
+    typedef T value_type;
+    bump_arena_t* arena;
+
+    bump_allocator(bump_arena_t* arena) : arena(arena) {}
+    template <typename U>
+    bump_allocator(const bump_allocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n)
+    {
+        T* p = (T*)arena->cursor;
+        arena->cursor += (n * sizeof(T) + BUMP_ALIGNMENT - 1) & ~((size_t)BUMP_ALIGNMENT - 1);
+        return p;
+    }
+
+    void deallocate(T*, size_t) {}
+};
+
+template <typename T, typename U>
+bool operator==(const bump_allocator<T>& a, const bump_allocator<U>& b)
+{
+    return a.arena == b.arena;
+}
+
+template <typename T, typename U>
+bool operator!=(const bump_allocator<T>& a, const bump_allocator<U>& b)
+{
+    return a.arena != b.arena;
+}
+
+template <typename T>
+using bump_vector = std::vector<T, bump_allocator<T>>;
+
+#ifdef REPLAY_GLIBC
+static void* smalloc(size_t size)
+{
+    return malloc(size);
+}
+
+static void* scalloc(size_t num, size_t size)
+{
+    return calloc(num, size);
+}
+
+static void sfree(void* p)
+{
+    free(p);
+}
+
+static void* srealloc(void* oldp, size_t size)
+{
+    return realloc(oldp, size);
+}
+
+static void* saligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+static void sfree_sized(void* p, size_t)
+{
+    free(p);
+}
+#else
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size) __attribute__((weak));
+void sfree(void* p) __attribute__((weak));
+void* srealloc(void* oldp, size_t size) __attribute__((weak));
+void* saligned_alloc(size_t alignment, size_t size) __attribute__((weak));
+void sfree_sized(void* p, size_t size) __attribute__((weak));
+#endif
+
+static bool _init_bump_arena(bump_arena_t* arena)
+{
+    void* start = mmap(nullptr, BUMP_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (start == (void*)(-1)) {
+        return false;
+    }
+    arena->start = arena->cursor = (uint8_t*)start;
+    return true;
+}
+
+static void _release_bump_arena(bump_arena_t* arena)
+{
+    munmap(arena->start, BUMP_ARENA_SIZE);
+    arena->start = arena->cursor = nullptr;
+}
+
+// The peak RSS of the process is reset to what it holds now, returns false if the kernel can't
+static bool _reset_peak_rss()
+{
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool reset = write(fd, "5", 1) == 1;
+    close(fd);
+    return reset;
+}
+
+static long _peak_rss_kb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static bool _read_trace(const char* path, bump_vector<trace_record_t>* records)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_t)) {
+        fclose(file);
+        return false;
+    }
+    // Reserved up front, the bump arena never reuses what a growing vector gives back
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long length = ftell(file);
+        if (length > (long)sizeof(header)) {
+            records->reserve((length - sizeof(header)) / sizeof(trace_record_t));
+        }
+        fseek(file, sizeof(header), SEEK_SET);
+    }
+    trace_record_t record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        records->push_back(record);
+    }
+    fclose(file);
+    return true;
+}
+
+// Orders the records of all threads by time and gives every block a dense id, failed allocations
+// and frees of addresses that were never seen are dropped
+static uint32_t _build_ops(bump_vector<trace_record_t>* records, bump_vector<replay_op_t>* ops, size_t* threads_num)
+{
+    std::stable_sort(records->begin(), records->end(), [](const trace_record_t& a, const trace_record_t& b) {
+        return a.timestamp < b.timestamp;
+    });
+    typedef std::pair<const uint64_t, uint32_t> live_entry_t;
+    std::unordered_map<uint64_t, uint32_t, std::hash<uint64_t>, std::equal_to<uint64_t>, bump_allocator<live_entry_t>>
+        live(0, std::hash<uint64_t>(), std::equal_to<uint64_t>(), bump_allocator<live_entry_t>(records->get_allocator().arena));
+    uint32_t ids_num = 0;
+    *threads_num = 0;
+    ops->reserve(records->size());
+    for (const trace_record_t& record : *records) {
+        *threads_num = std::max(*threads_num, (size_t)record.thread + 1);
+        if (IS_FREE_OP(record.op)) {
+            auto it = live.find(record.address);
+            if (it != live.end()) {
+                ops->push_back({ record.op, it->second, NO_ID, record.size, 0 });
+                live.erase(it);
+            }
+            continue;
+        }
+        if (record.address == 0) {
+            continue;
+        }
+        uint32_t old_id = NO_ID;
+        auto it = live.find(record.old_address);
+        if (record.op == TRACE_REALLOC && record.old_address && it != live.end()) {
+            old_id = it->second;
+            live.erase(it);
+        }
+        live[record.address] = ids_num;
+        uint64_t alignment = (record.op == TRACE_ALIGNED_ALLOC) ? record.old_address : 0;
+        ops->push_back({ record.op, ids_num++, old_id, record.size, alignment });
+    }
+    return ids_num;
+}
+
+static void* _replay_realloc(void* oldp, size_t old_size, size_t size)
+{
+    if (IS_AVAILABLE(srealloc)) {
+        return srealloc(oldp, size);
+    }
+    void* newp = smalloc(size);
+    if (newp && oldp) {
+        memmove(newp, oldp, std::min(old_size, size));
+        if (IS_AVAILABLE(sfree)) {
+            sfree(oldp);
+        }
+    }
+    return newp;
+}
+
+// Allocators without saligned_alloc get a plain allocation
+static void* _replay_aligned_alloc(size_t alignment, size_t size)
+{
+    return (IS_AVAILABLE(saligned_alloc)) ? saligned_alloc(alignment, size) : smalloc(size);
+}
+
+static void _replay_free(const replay_op_t* op, void* p)
+{
+    if (op->op == TRACE_FREE_SIZED && IS_AVAILABLE(sfree_sized)) {
+        sfree_sized(p, op->size);
+    } else if (IS_AVAILABLE(sfree)) {
+        sfree(p);
+    }
+}
+
+static void* _replay_calloc(size_t size)
+{
+    if (IS_AVAILABLE(scalloc)) {
+        return scalloc(1, size);
+    }
+    void* p = smalloc(size);
+    if (p) {
+        memset(p, 0, size);
+    }
+    return p;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <trace>\n", argv[0]);
+        return 1;
+    }
+    bump_arena_t trace_arena;
+    bump_arena_t replay_arena;
+    if (!_init_bump_arena(&trace_arena) || !_init_bump_arena(&replay_arena)) {
+        fprintf(stderr, "%s: can't map the replay bookkeeping\n", argv[0]);
+        return 1;
+    }
+    bump_vector<replay_op_t> ops(&replay_arena);
+    size_t threads_num;
+    uint32_t ids_num;
+    {
+        bump_vector<trace_record_t> records(&trace_arena);
+        if (!_read_trace(argv[1], &records)) {
+            fprintf(stderr, "%s: can't read trace %s\n", argv[0], argv[1]);
+            return 1;
+        }
+        ids_num = _build_ops(&records, &ops, &threads_num);
+    }
+    _release_bump_arena(&trace_arena);
+    bump_vector<void*> blocks(ids_num, nullptr, &replay_arena);
+    bump_vector<uint64_t> sizes(ids_num, 0, &replay_arena);
+    bump_vector<uint32_t> latencies(ops.size(), 0, &replay_arena);
+    // Without the reset the peak would be the one of reading the trace
+    long base_rss_kb = (_reset_peak_rss()) ? _peak_rss_kb() : 0;
+#ifndef REPLAY_GLIBC
+    // Everything the replay needs is allocated by now, glibc must not move the program break
+    // under the allocator if it allocates anyway
+    mallopt(M_MMAP_THRESHOLD, 0);
+    heap_start = sbrk(0);
+#endif
+    size_t live_bytes = 0;
+    size_t peak_live_bytes = 0;
+    size_t peak_heap_bytes = 0;
+    uint64_t total_ns = 0;
+    for (size_t i = 0; i < ops.size(); i++) {
+        const replay_op_t* op = &ops[i];
+        void* p = nullptr;
+        uint64_t start = _now_ns();
+        switch (op->op) {
+        case TRACE_MALLOC:
+            p = smalloc(op->size);
+            break;
+        case TRACE_CALLOC:
+            p = _replay_calloc(op->size);
+            break;
+        case TRACE_REALLOC:
+            p = _replay_realloc((op->old_id != NO_ID) ? blocks[op->old_id] : nullptr, (op->old_id != NO_ID) ? sizes[op->old_id] : 0, op->size);
+            break;
+        case TRACE_FREE:
+        case TRACE_FREE_SIZED:
+            _replay_free(op, blocks[op->id]);
+            break;
+        case TRACE_ALIGNED_ALLOC:
+            p = _replay_aligned_alloc(op->alignment, op->size);
+            break;
+        }
+        latencies[i] = _now_ns() - start;
+        total_ns += latencies[i];
+        if (IS_FREE_OP(op->op)) {
+            live_bytes -= sizes[op->id];
+            blocks[op->id] = nullptr;
+        } else if (p && op->old_id != NO_ID) {
+            live_bytes -= sizes[op->old_id];
+            blocks[op->old_id] = nullptr;
+        }
+        if (!IS_FREE_OP(op->op) && p) {
+            blocks[op->id] = p;
+            sizes[op->id] = op->size;
+            live_bytes += op->size;
+            for (size_t offset = 0; offset < op->size; offset += OS_PAGE_SIZE) {
+                ((volatile uint8_t*)p)[offset] = 1;
+            }
+        }
+        if (live_bytes > peak_live_bytes) {
+            peak_live_bytes = live_bytes;
+            peak_heap_bytes = _heap_bytes();
+        }
+    }
+    uint32_t p99_ns = 0;
+    if (!latencies.empty()) {
+        auto p99 = latencies.begin() + latencies.size() * 99 / 100;
+        std::nth_element(latencies.begin(), p99, latencies.end());
+        p99_ns = *p99;
+    }
+    // The part of the heap at the peak that did not hold live bytes
+    double fragmentation = (peak_heap_bytes > peak_live_bytes) ? 1.0 - (double)peak_live_bytes / peak_heap_bytes : 0.0;
+    printf("allocator,ops,threads,seconds,p99_ns,peak_rss_kb,peak_live_bytes,peak_heap_bytes,fragmentation\n");
+    printf("%s,%zu,%zu,%.3f,%u,%ld,%zu,%zu,%.3f\n", REPLAY_ALLOCATOR, ops.size(), threads_num, total_ns / 1e9, p99_ns, _peak_rss_kb() - base_rss_kb, peak_live_bytes, peak_heap_bytes, fragmentation);
+    return 0;
+}
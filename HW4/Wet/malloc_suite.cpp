@@ -0,0 +1,290 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "malloc_tools.h"
+
+// Standard workloads run against the allocator this is linked with, one row of CSV per workload.
+// Every workload runs in a forked child so it starts from an empty heap. Every call is timed for
+// the mean and tail latency, the fragmentation is the part of the heap that does not hold live
+// bytes once the workload allocated its live set. malloc_1..3 are not thread safe, the larson
+// workload only runs with more than one thread when built with SUITE_THREAD_SAFE
+#define MAX_THREADS 4
+#define MAX_OPS (200 * 1000)
+#define RANDOM_SIZES_OPS (100 * 1000)
+#define RANDOM_SIZES_BATCH 1000
+#define RANDOM_SIZES_MAX_SIZE (16 * 1024)
+#define LARSON_OPS (200 * 1000)
+#define LARSON_LIVE_BLOCKS 1024
+#define LARSON_ROUND_OPS 10000 // the live blocks move to the next thread after every round
+#define LARSON_MAX_SIZE 512
+#define REALLOC_GROWTH_BUFFERS 64
+#define REALLOC_GROWTH_STEPS 256
+#define REALLOC_GROWTH_STEP 64
+#define CHURN_OPS (100 * 1000)
+#define CHURN_LIVE_BLOCKS 2048
+#define CHURN_MAX_SIZE 1024
+#define LARGE_MIX_OPS (4 * 1000)
+#define LARGE_MIX_LIVE_BLOCKS 32
+#define LARGE_MIX_MAX_SIZE (1024 * 1024)
+#ifndef SUITE_ALLOCATOR
+#define SUITE_ALLOCATOR "malloc"
+#endif
+#ifdef SUITE_THREAD_SAFE
+#define LARSON_THREADS MAX_THREADS
+#else
+#define LARSON_THREADS 1
+#endif
+
+void* smalloc(size_t size);
+void sfree(void* p) __attribute__((weak));
+void* srealloc(void* oldp, size_t size) __attribute__((weak));
+
+typedef struct {
+    const char* name;
+    size_t threads_num;
+    size_t ops;
+    double seconds;
+    size_t live_bytes;
+    size_t heap_bytes;
+} suite_result_t;
+
+typedef struct {
+    size_t index;
+    size_t ops;
+    unsigned int seed;
+} larson_args_t;
+
+static uint32_t latencies[MAX_THREADS][MAX_OPS];
+static void* larson_live[MAX_THREADS][LARSON_LIVE_BLOCKS];
+static size_t larson_sizes[MAX_THREADS][LARSON_LIVE_BLOCKS];
+static pthread_barrier_t larson_barrier;
+
+static void* _timed_malloc(uint32_t* latency, size_t size)
+{
+    uint64_t start = _now_ns();
+    void* p = smalloc(size);
+    *latency = _now_ns() - start;
+    if (p) {
+        *(volatile uint8_t*)p = 1;
+    }
+    return p;
+}
+
+static void _timed_free(uint32_t* latency, void* p)
+{
+    uint64_t start = _now_ns();
+    if (IS_AVAILABLE(sfree)) {
+        sfree(p);
+    }
+    *latency = _now_ns() - start;
+}
+
+static void* _timed_realloc(uint32_t* latency, void* oldp, size_t old_size, size_t size)
+{
+    uint64_t start = _now_ns();
+    void* newp;
+    if (IS_AVAILABLE(srealloc)) {
+        newp = srealloc(oldp, size);
+    } else {
+        newp = smalloc(size);
+        if (newp && oldp) {
+            memmove(newp, oldp, old_size);
+        }
+    }
+    *latency = _now_ns() - start;
+    return newp;
+}
+
+// Log uniform sizes allocated in batches and then freed in a random order
+static void _random_sizes(suite_result_t* result)
+{
+    static void* batch[RANDOM_SIZES_BATCH];
+    unsigned int seed = 1;
+    size_t op = 0;
+    while (op < RANDOM_SIZES_OPS) {
+        size_t live_bytes = 0;
+        for (size_t i = 0; i < RANDOM_SIZES_BATCH; i++) {
+            size_t size = 8 + rand_r(&seed) % ((size_t)8 << (rand_r(&seed) % 11));
+            size = std::min(size, (size_t)RANDOM_SIZES_MAX_SIZE);
+            batch[i] = _timed_malloc(&latencies[0][op++], size);
+            live_bytes += size;
+        }
+        if (result->live_bytes == 0) {
+            result->live_bytes = live_bytes;
+            result->heap_bytes = _heap_bytes();
+        }
+        for (size_t i = RANDOM_SIZES_BATCH - 1; i > 0; i--) {
+            std::swap(batch[i], batch[rand_r(&seed) % (i + 1)]);
+        }
+        for (size_t i = 0; i < RANDOM_SIZES_BATCH; i++) {
+            _timed_free(&latencies[0][op++], batch[i]);
+        }
+    }
+    result->ops = op;
+}
+
+static void* _larson_worker(void* arg)
+{
+    larson_args_t* args = (larson_args_t*)arg;
+    size_t owner = args->index;
+    for (size_t op = 0; op < args->ops; op++) {
+        // Blocks allocated by one thread are freed by the next one
+        if (op % LARSON_ROUND_OPS == 0 && op != 0) {
+            pthread_barrier_wait(&larson_barrier);
+            owner = (owner + 1) % LARSON_THREADS;
+        }
+        size_t slot = rand_r(&args->seed) % LARSON_LIVE_BLOCKS;
+        if (larson_live[owner][slot]) {
+            _timed_free(&latencies[args->index][op], larson_live[owner][slot]);
+            larson_live[owner][slot] = nullptr;
+            continue;
+        }
+        larson_sizes[owner][slot] = rand_r(&args->seed) % LARSON_MAX_SIZE + 1;
+        larson_live[owner][slot] = _timed_malloc(&latencies[args->index][op], larson_sizes[owner][slot]);
+    }
+    return nullptr;
+}
+
+static void _larson(suite_result_t* result)
+{
+    pthread_t threads[MAX_THREADS];
+    larson_args_t args[MAX_THREADS];
+    pthread_barrier_init(&larson_barrier, nullptr, LARSON_THREADS);
+    for (size_t i = 0; i < LARSON_THREADS; i++) {
+        args[i] = { i, LARSON_OPS / LARSON_THREADS, (unsigned int)i + 1 };
+        pthread_create(&threads[i], nullptr, _larson_worker, &args[i]);
+    }
+    for (size_t i = 0; i < LARSON_THREADS; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+    pthread_barrier_destroy(&larson_barrier);
+    for (size_t i = 0; i < LARSON_THREADS; i++) {
+        for (size_t slot = 0; slot < LARSON_LIVE_BLOCKS; slot++) {
+            result->live_bytes += (larson_live[i][slot]) ? larson_sizes[i][slot] : 0;
+        }
+    }
+    result->heap_bytes = _heap_bytes();
+    result->threads_num = LARSON_THREADS;
+    result->ops = LARSON_OPS / LARSON_THREADS * LARSON_THREADS;
+}
+
+// Buffers grown side by side a little at a time, the way strings and vectors grow
+static void _realloc_growth(suite_result_t* result)
+{
+    static void* buffers[REALLOC_GROWTH_BUFFERS];
+    size_t op = 0;
+    for (size_t step = 1; step <= REALLOC_GROWTH_STEPS; step++) {
+        for (size_t i = 0; i < REALLOC_GROWTH_BUFFERS; i++) {
+            buffers[i] = _timed_realloc(&latencies[0][op++], buffers[i], (step - 1) * REALLOC_GROWTH_STEP, step * REALLOC_GROWTH_STEP);
+        }
+    }
+    result->live_bytes = REALLOC_GROWTH_BUFFERS * REALLOC_GROWTH_STEPS * REALLOC_GROWTH_STEP;
+    result->heap_bytes = _heap_bytes();
+    result->ops = op;
+}
+
+// Random frees and allocations over a fixed live set
+static void _churn(suite_result_t* result)
+{
+    static void* live[CHURN_LIVE_BLOCKS];
+    static size_t sizes[CHURN_LIVE_BLOCKS];
+    unsigned int seed = 1;
+    size_t op = 0;
+    for (size_t slot = 0; slot < CHURN_LIVE_BLOCKS; slot++) {
+        sizes[slot] = rand_r(&seed) % CHURN_MAX_SIZE + 1;
+        live[slot] = _timed_malloc(&latencies[0][op++], sizes[slot]);
+    }
+    while (op < CHURN_OPS) {
+        size_t slot = rand_r(&seed) % CHURN_LIVE_BLOCKS;
+        _timed_free(&latencies[0][op++], live[slot]);
+        sizes[slot] = rand_r(&seed) % CHURN_MAX_SIZE + 1;
+        live[slot] = _timed_malloc(&latencies[0][op++], sizes[slot]);
+    }
+    for (size_t slot = 0; slot < CHURN_LIVE_BLOCKS; slot++) {
+        result->live_bytes += sizes[slot];
+    }
+    result->heap_bytes = _heap_bytes();
+    result->ops = op;
+}
+
+// Mostly small blocks with one in eight up to 1MB, the large ones are mmap blocks where there are any
+static void _large_mix(suite_result_t* result)
+{
+    static void* live[LARGE_MIX_LIVE_BLOCKS];
+    static size_t sizes[LARGE_MIX_LIVE_BLOCKS];
+    unsigned int seed = 1;
+    size_t op = 0;
+    while (op < LARGE_MIX_OPS) {
+        size_t slot = rand_r(&seed) % LARGE_MIX_LIVE_BLOCKS;
+        if (live[slot]) {
+            _timed_free(&latencies[0][op++], live[slot]);
+        }
+        sizes[slot] = (rand_r(&seed) % 8 == 0) ? rand_r(&seed) % LARGE_MIX_MAX_SIZE + 1 : rand_r(&seed) % 4096 + 1;
+        live[slot] = _timed_malloc(&latencies[0][op++], sizes[slot]);
+    }
+    for (size_t slot = 0; slot < LARGE_MIX_LIVE_BLOCKS; slot++) {
+        result->live_bytes += (live[slot]) ? sizes[slot] : 0;
+    }
+    result->heap_bytes = _heap_bytes();
+    result->ops = op;
+}
+
+static void _report(const suite_result_t* result)
+{
+    static uint32_t all[MAX_THREADS * MAX_OPS];
+    size_t ops_per_thread = result->ops / result->threads_num;
+    size_t count = 0;
+    uint64_t total_ns = 0;
+    for (size_t i = 0; i < result->threads_num; i++) {
+        for (size_t op = 0; op < ops_per_thread; op++) {
+            all[count++] = latencies[i][op];
+            total_ns += latencies[i][op];
+        }
+    }
+    uint32_t* p99 = all + count * 99 / 100;
+    std::nth_element(all, p99, all + count);
+    double fragmentation = (result->heap_bytes > result->live_bytes) ? 1.0 - (double)result->live_bytes / result->heap_bytes : 0.0;
+    size_t meta_data_bytes = IS_AVAILABLE(_num_meta_data_bytes) ? _num_meta_data_bytes() : 0;
+    printf("%s,%s,%zu,%zu,%.0f,%.0f,%u,%zu,%.3f\n", result->name, SUITE_ALLOCATOR, result->threads_num, result->ops, result->ops / result->seconds, (double)total_ns / count, *p99, meta_data_bytes, fragmentation);
+    fflush(stdout);
+}
+
+int main()
+{
+    // glibc's own allocations (thread stacks, stdio) must not move the program break under smalloc
+    mallopt(M_MMAP_THRESHOLD, 0);
+    heap_start = sbrk(0);
+    struct {
+        const char* name;
+        void (*run)(suite_result_t* result);
+    } workloads[] = {
+        { "random_sizes", _random_sizes },
+        { "larson", _larson },
+        { "realloc_growth", _realloc_growth },
+        { "churn", _churn },
+        { "large_mix", _large_mix },
+    };
+    printf("workload,allocator,threads,ops,ops_per_sec,mean_ns,p99_ns,meta_data_bytes,fragmentation\n");
+    fflush(stdout);
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            suite_result_t result = { workloads[i].name, 1, 0, 0, 0, 0 };
+            uint64_t start = _now_ns();
+            workloads[i].run(&result);
+            result.seconds = (_now_ns() - start) / 1e9;
+            _report(&result);
+            _exit(0);
+        }
+        waitpid(pid, nullptr, 0);
+    }
+    return 0;
+}
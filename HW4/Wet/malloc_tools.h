@@ -0,0 +1,49 @@
+#ifndef __MALLOC_TOOLS_H__
+#define __MALLOC_TOOLS_H__
+#include <cstddef>
+#include <cstdint>
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+
+// The timing and heap size helpers of the benchmark, the replay and the suite. The heap is measured
+// with glibc's mallinfo2 when built with MALLOC_TOOLS_GLIBC
+
+#ifdef MALLOC_TOOLS_GLIBC
+#define IS_AVAILABLE(function) true
+#else
+// malloc_1 only has smalloc, the rest is missing from it
+#define IS_AVAILABLE(function) (function != nullptr)
+#endif
+
+size_t _num_allocated_bytes() __attribute__((weak));
+size_t _num_meta_data_bytes() __attribute__((weak));
+
+static inline uint64_t _now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 * 1000 * 1000 + now.tv_nsec;
+}
+
+#ifdef MALLOC_TOOLS_GLIBC
+static inline size_t _heap_bytes()
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+}
+#else
+// Set to sbrk(0) before the first allocation, the heap of malloc_1 is measured from it
+static void* heap_start = nullptr;
+
+// The allocated counters cover the free blocks as well
+static inline size_t _heap_bytes()
+{
+    if (IS_AVAILABLE(_num_allocated_bytes) && IS_AVAILABLE(_num_meta_data_bytes)) {
+        return _num_allocated_bytes() + _num_meta_data_bytes();
+    }
+    return (uint8_t*)sbrk(0) - (uint8_t*)heap_start;
+}
+#endif
+
+#endif
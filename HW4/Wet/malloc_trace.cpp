@@ -0,0 +1,266 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "malloc_trace.h"
+
+// Records every allocation and free of the allocator it is linked with, the plain, aligned, sized
+// and batch entry points alike. The allocator is compiled with its entry points renamed to
+// _untraced_* (see TRACE_FLAGS in the Makefile) and these wrappers take their place. Each thread
+// fills a buffer of its own without any lock and appends it to MALLOC4_TRACE.<pid>
+// (malloc.trace.<pid> by default) when it is full, when the thread exits and when the process
+// exits. Replay the file with malloc_replay_*
+#define TRACE_ENV "MALLOC4_TRACE" // not MALLOC_TRACE, glibc's mtrace reads that one
+#define TRACE_DEFAULT_PREFIX "malloc.trace"
+#define TRACE_BUFFER_RECORDS 4096
+
+typedef struct trace_buffer {
+    struct trace_buffer* next;
+    // Cleared when the thread that owns the buffer exits so the next new thread takes it
+    bool in_use;
+    // Set while the owner adds to the buffer, the final flush waits for it
+    bool writing;
+    uint16_t thread;
+    size_t count;
+    trace_record_t records[TRACE_BUFFER_RECORDS];
+} trace_buffer_t;
+
+void* _untraced_smalloc(size_t size);
+void* _untraced_scalloc(size_t num, size_t size) __attribute__((weak));
+void _untraced_sfree(void* p) __attribute__((weak));
+void* _untraced_srealloc(void* oldp, size_t size) __attribute__((weak));
+void* _untraced_saligned_alloc(size_t alignment, size_t size) __attribute__((weak));
+void _untraced_sfree_sized(void* p, size_t size) __attribute__((weak));
+size_t _untraced_smalloc_batch(size_t size, size_t n, void** out) __attribute__((weak));
+void _untraced_sfree_batch(void** ptrs, size_t n) __attribute__((weak));
+
+static int trace_fd = -1;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static trace_buffer_t* trace_buffers = nullptr;
+static uint16_t next_thread = 0;
+static bool trace_stopped = false;
+static __thread trace_buffer_t* thread_buffer = nullptr;
+
+static void _open_trace()
+{
+    const char* prefix = getenv(TRACE_ENV);
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%d", (prefix) ? prefix : TRACE_DEFAULT_PREFIX, (int)getpid());
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (trace_fd >= 0) {
+        trace_header_t header = { TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record_t), 0 };
+        if (write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+            close(trace_fd);
+            trace_fd = -1;
+        }
+    }
+}
+
+// O_APPEND makes every write of a whole buffer land in one piece
+static void _flush_buffer(trace_buffer_t* buffer)
+{
+    if (buffer->count != 0 && trace_fd >= 0) {
+        size_t length = buffer->count * sizeof(trace_record_t);
+        if (write(trace_fd, buffer->records, length) != (ssize_t)length) {
+            close(trace_fd);
+            trace_fd = -1;
+        }
+    }
+    buffer->count = 0;
+}
+
+// The writing flag and trace_stopped are sequentially consistent so either the final flush sees
+// the buffer being written to and waits, or the writer sees the trace stopped and backs off
+static bool _begin_write(trace_buffer_t* buffer)
+{
+    __atomic_store_n(&buffer->writing, true, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&trace_stopped, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&buffer->writing, false, __ATOMIC_RELEASE);
+        return false;
+    }
+    return true;
+}
+
+static void _end_write(trace_buffer_t* buffer)
+{
+    __atomic_store_n(&buffer->writing, false, __ATOMIC_RELEASE);
+}
+
+// Once the trace is stopped the final flush writes what is left in the buffer
+static void _release_buffer(void* buffer)
+{
+    if (_begin_write((trace_buffer_t*)buffer)) {
+        _flush_buffer((trace_buffer_t*)buffer);
+        _end_write((trace_buffer_t*)buffer);
+    }
+    __atomic_store_n(&((trace_buffer_t*)buffer)->in_use, false, __ATOMIC_RELEASE);
+}
+
+// The child starts a trace file of its own, the records it inherited belong to the parent
+static void _trace_fork_child()
+{
+    for (trace_buffer_t* buffer = trace_buffers; buffer; buffer = buffer->next) {
+        buffer->count = 0;
+    }
+    if (trace_fd >= 0) {
+        close(trace_fd);
+    }
+    _open_trace();
+}
+
+static void _init_trace()
+{
+    _open_trace();
+    pthread_key_create(&trace_key, _release_buffer);
+    pthread_atfork(nullptr, nullptr, _trace_fork_child);
+}
+
+// Buffers are mapped directly so tracing never allocates through the allocator it traces
+static trace_buffer_t* _thread_buffer()
+{
+    if (thread_buffer) {
+        return thread_buffer;
+    }
+    pthread_once(&trace_once, _init_trace);
+    trace_buffer_t* buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE);
+    for (; buffer; buffer = buffer->next) {
+        bool in_use = false;
+        if (__atomic_compare_exchange_n(&buffer->in_use, &in_use, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (buffer == nullptr) {
+        void* region = mmap(nullptr, sizeof(trace_buffer_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == (void*)(-1)) {
+            return nullptr;
+        }
+        buffer = (trace_buffer_t*)region;
+        buffer->in_use = true;
+        buffer->next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_buffers, &buffer->next, buffer, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    buffer->thread = __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED);
+    thread_buffer = buffer;
+    pthread_setspecific(trace_key, buffer);
+    return buffer;
+}
+
+static uint64_t _timestamp()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 * 1000 * 1000 + now.tv_nsec;
+}
+
+// The timestamp of a free is taken before the block is released and the timestamp of an allocation
+// after it returned, so a reused address is always ordered after the free that gave it back
+static void _record(trace_op_e op, uint64_t timestamp, void* address, void* old_address, size_t size)
+{
+    trace_buffer_t* buffer = _thread_buffer();
+    if (buffer == nullptr || !_begin_write(buffer)) {
+        return;
+    }
+    trace_record_t* record = &buffer->records[buffer->count++];
+    record->timestamp = timestamp;
+    record->address = (uint64_t)address;
+    record->old_address = (uint64_t)old_address;
+    record->size = size;
+    record->thread = buffer->thread;
+    record->op = op;
+    record->reserved = 0;
+    if (buffer->count == TRACE_BUFFER_RECORDS) {
+        _flush_buffer(buffer);
+    }
+    _end_write(buffer);
+}
+
+// Buffers of threads that are still running are flushed as well. Recording stops first and a record
+// that is being added is waited for, the ones threads try to add after this are dropped
+__attribute__((destructor)) static void _flush_trace()
+{
+    __atomic_store_n(&trace_stopped, true, __ATOMIC_SEQ_CST);
+    for (trace_buffer_t* buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer; buffer = buffer->next) {
+        while (__atomic_load_n(&buffer->writing, __ATOMIC_SEQ_CST)) {
+            sched_yield();
+        }
+        _flush_buffer(buffer);
+    }
+}
+
+void* smalloc(size_t size)
+{
+    void* p = _untraced_smalloc(size);
+    _record(TRACE_MALLOC, _timestamp(), p, nullptr, size);
+    return p;
+}
+
+void* scalloc(size_t num, size_t size)
+{
+    void* p = (_untraced_scalloc) ? _untraced_scalloc(num, size) : nullptr;
+    _record(TRACE_CALLOC, _timestamp(), p, nullptr, num * size);
+    return p;
+}
+
+void sfree(void* p)
+{
+    _record(TRACE_FREE, _timestamp(), p, nullptr, 0);
+    if (_untraced_sfree) {
+        _untraced_sfree(p);
+    }
+}
+
+// Both the release of the old block and the new block are covered by one record, its timestamp is
+// taken before the call so a free of the new address can't come before it. An address another
+// thread frees into this very call can still be ordered after it, the replay tolerates that
+void* srealloc(void* oldp, size_t size)
+{
+    uint64_t timestamp = _timestamp();
+    void* newp = (_untraced_srealloc) ? _untraced_srealloc(oldp, size) : nullptr;
+    _record(TRACE_REALLOC, timestamp, newp, oldp, size);
+    return newp;
+}
+
+void* saligned_alloc(size_t alignment, size_t size)
+{
+    void* p = (_untraced_saligned_alloc) ? _untraced_saligned_alloc(alignment, size) : nullptr;
+    _record(TRACE_ALIGNED_ALLOC, _timestamp(), p, (void*)alignment, size);
+    return p;
+}
+
+void sfree_sized(void* p, size_t size)
+{
+    _record(TRACE_FREE_SIZED, _timestamp(), p, nullptr, size);
+    if (_untraced_sfree_sized) {
+        _untraced_sfree_sized(p, size);
+    }
+}
+
+// One record per block, all of them with the timestamp of the call
+size_t smalloc_batch(size_t size, size_t n, void** out)
+{
+    size_t count = (_untraced_smalloc_batch) ? _untraced_smalloc_batch(size, n, out) : 0;
+    uint64_t timestamp = _timestamp();
+    for (size_t i = 0; i < count; i++) {
+        _record(TRACE_MALLOC, timestamp, out[i], nullptr, size);
+    }
+    return count;
+}
+
+void sfree_batch(void** ptrs, size_t n)
+{
+    uint64_t timestamp = _timestamp();
+    for (size_t i = 0; i < n; i++) {
+        _record(TRACE_FREE, timestamp, ptrs[i], nullptr, 0);
+    }
+    if (_untraced_sfree_batch) {
+        _untraced_sfree_batch(ptrs, n);
+    }
+}
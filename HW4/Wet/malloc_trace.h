@@ -0,0 +1,38 @@
+#ifndef __MALLOC_TRACE_H__
+#define __MALLOC_TRACE_H__
+#include <cstdint>
+
+#define TRACE_MAGIC 0x4352544d // "MTRC"
+#define TRACE_VERSION 2 // 2 widened the size to 64 bits
+
+typedef enum {
+    TRACE_MALLOC,
+    TRACE_CALLOC,
+    TRACE_REALLOC,
+    TRACE_FREE,
+    TRACE_ALIGNED_ALLOC,
+    TRACE_FREE_SIZED
+} trace_op_e;
+
+// The address is what the call returned (or freed), it is the address id. The replay densifies
+// the ids since an address is reused once its block is freed. A batch call is recorded as one
+// TRACE_MALLOC or TRACE_FREE per block
+typedef struct {
+    uint64_t timestamp; // nanoseconds
+    uint64_t address;
+    uint64_t old_address; // srealloc only, saligned_alloc keeps the alignment here
+    uint64_t size;
+    uint16_t thread;
+    uint8_t op;
+    uint8_t reserved;
+} trace_record_t;
+
+// The file starts with this header and the records follow
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+} trace_header_t;
+
+#endif